@@ -0,0 +1,586 @@
+// Times every planner phase on synthetic terrains of several sizes and
+// local resolutions. Results are written as one JSON object per line:
+//
+//   path_planning_benchmark [results.jsonl] [iterations] [seed]
+//
+// Every iteration uses a new planner, so no phase benefits from state left
+// by the previous one. The planner log is discarded while timing. Besides
+// the phases, the suite compares:
+//  - full and delta ingestion of 512x512 and 1024x1024 frames of a rover
+//    driving past a fixed obstacle field, in frames per second
+//  - the Eikonal and distance transform risk engines on a dense obstacle
+//    scene with 1, 2, 4 and 8 threads, and how much their risk differs
+//  - getGlobalPath with and without the precomputed gradient field
+// The cost map log is measured on the total cost and risk maps exported
+// while the rover drives along the path, as compression ratio and MB/s
+
+#include "PathPlanning.hpp"
+#include "PlannerLog.hpp"
+#include "CostMapLog.hpp"
+#include "TerrainGenerator.hpp"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <math.h>
+#include <sstream>
+#include <stdlib.h>
+
+using namespace PathPlanning_lib;
+
+struct benchmarkResult
+{
+    std::string phase;
+    uint size;
+    uint ratioScale;
+    uint64_t seed;
+    std::vector<double> samples; //Seconds
+    std::string rateName; //Items processed, reported per second if not empty
+    double rateCount; //Items summed over samples
+};
+
+struct agreementResult
+{
+    std::string benchmark;
+    uint size;
+    uint ratioScale;
+    uint64_t seed;
+    uint64_t nodes; //Local nodes with risk in either field
+    double maxDifference;
+    double sumDifference;
+};
+
+struct logResult
+{
+    std::string benchmark;
+    uint size;
+    uint ratioScale;
+    uint64_t seed;
+    costMapLogStatistics statistics; //Summed over iterations
+};
+
+static PathPlanning* createPlanner(std::vector<terrainType*>& table)
+{
+  // Terrains 0 (obstacle), 1 and 2, locomotion modes DRIVING and
+  // WHEEL_WALKING, costs per slope of 0, 10, 20 and 30 degrees
+    const char* optimal[3] = {"DRIVING", "DRIVING", "WHEEL_WALKING"};
+    const double costs[3][2][4] = {{{40, 40, 40, 40}, {40, 40, 40, 40}},
+                                   {{1.0, 1.5, 3.0, 8.0}, {2.0, 2.5, 3.5, 6.0}},
+                                   {{3.0, 4.0, 7.0, 15.0}, {2.0, 2.5, 4.0, 9.0}}};
+    std::vector<double> costData;
+    for (uint t = 0; t < 3; t++)
+        for (uint m = 0; m < 2; m++)
+            for (uint s = 0; s < 4; s++)
+                costData.push_back(costs[t][m][s]);
+    std::vector<double> slopes;
+    for (uint s = 0; s < 4; s++)
+        slopes.push_back(10.0*s);
+    std::vector<std::string> modes;
+    modes.push_back("DRIVING");
+    modes.push_back("WHEEL_WALKING");
+
+    table.clear();
+    for (uint t = 0; t < 3; t++)
+    {
+        terrainType* terrain = new terrainType;
+        terrain->cost = costs[t][0][0];
+        terrain->optimalLM = optimal[t];
+        table.push_back(terrain);
+    }
+    return new PathPlanning(table, costData, slopes, modes);
+}
+
+static void destroyPlanner(PathPlanning* planner, std::vector<terrainType*>& table)
+{
+    delete planner;
+    for (uint t = 0; t < table.size(); t++)
+        delete table[t];
+    table.clear();
+}
+
+// Pose for which ingestTraversabilityMap places the central pixel of a
+// width x height frame on target
+static base::Waypoint framePose(const base::Waypoint& target, uint width, uint height,
+                                double localCellSize)
+{
+    base::Waypoint wPos = target;
+    wPos.position[0] = target.position[0] + width/2 - (width/2)*localCellSize;
+    wPos.position[1] = target.position[1] + height/2 - (height/2)*localCellSize;
+    return wPos;
+}
+
+static double elapsed(const base::Time& start)
+{
+    return (base::Time::now() - start).toSeconds();
+}
+
+static void addSample(std::vector<benchmarkResult>& results, const std::string& phase,
+                      uint size, uint ratioScale, uint64_t seed, double seconds,
+                      const std::string& rateName = "", double rateCount = 0)
+{
+    for (uint k = 0; k < results.size(); k++)
+        if ((results[k].phase == phase)&&(results[k].size == size)&&
+            (results[k].ratioScale == ratioScale))
+        {
+            results[k].samples.push_back(seconds);
+            results[k].rateCount += rateCount;
+            return;
+        }
+    benchmarkResult result;
+    result.phase = phase;
+    result.size = size;
+    result.ratioScale = ratioScale;
+    result.seed = seed;
+    result.samples.push_back(seconds);
+    result.rateName = rateName;
+    result.rateCount = rateCount;
+    results.push_back(result);
+}
+
+static std::string caseName(const std::string& phase, const std::string& variant, uint value)
+{
+    std::ostringstream name;
+    name << phase << " " << variant << value;
+    return name.str();
+}
+
+static void runCase(uint size, uint ratioScale, uint64_t seed, uint iteration,
+                    std::vector<benchmarkResult>& results)
+{
+    TerrainGenerator generator(seed + 7919*iteration);
+    syntheticTerrain terrain;
+    generator.generate(size, 0.08*size, 0.02, terrain);
+
+    double localCellSize = 1.0/ratioScale;
+    uint frameSize = 8*ratioScale;
+    base::samples::frame::Frame frame;
+    generator.obstacleFrame(frameSize, frameSize, 0.002, ratioScale, frame);
+    base::Pose2D offset;
+
+  // Global phases, then the whole local update as the rover runs it
+    std::vector<terrainType*> table;
+    PathPlanning* planner = createPlanner(table);
+    base::Time start = base::Time::now();
+    planner->initGlobalMap(1.0, localCellSize, offset, terrain.elevation, terrain.cost);
+    addSample(results, "initGlobalMap", size, ratioScale, seed, elapsed(start));
+
+    planner->setGoal(terrain.goal);
+    start = base::Time::now();
+    planner->calculateGlobalPropagation(terrain.start);
+    addSample(results, "calculateGlobalPropagation", size, ratioScale, seed, elapsed(start));
+
+    start = base::Time::now();
+    std::vector<base::Waypoint> trajectory = planner->getNewPath(terrain.start);
+    addSample(results, "getGlobalPath", size, ratioScale, seed, elapsed(start),
+              "waypoints", trajectory.size());
+
+    if (trajectory.size() < 2)
+    {
+        destroyPlanner(planner, table);
+        return;
+    }
+
+  // The same path integrated from the nodes of the global map, as before
+  // the gradient field existed. The field is built again with the next
+  // propagation
+    planner->globalGradient.isValid = false;
+    start = base::Time::now();
+    std::vector<base::Waypoint> nodeTrajectory = planner->getNewPath(terrain.start);
+    addSample(results, "getGlobalPath without gradient field", size, ratioScale, seed,
+              elapsed(start), "waypoints", nodeTrajectory.size());
+    trajectory = planner->getNewPath(terrain.start);
+  // The rover stands where the frame is centered, with its local maps built
+    base::Waypoint rover = trajectory[2*trajectory.size()/5];
+    base::Waypoint wPos = framePose(rover, frameSize, frameSize, localCellSize);
+    start = base::Time::now();
+    planner->updateLocalMap(rover);
+    addSample(results, "updateLocalMap", size, ratioScale, seed, elapsed(start));
+
+    start = base::Time::now();
+    planner->evaluateLocalMap(wPos, frame, localCellSize, trajectory);
+    addSample(results, "evaluateLocalMap", size, ratioScale, seed, elapsed(start));
+    destroyPlanner(planner, table);
+
+  // The same local update phase by phase on a planner in the same state
+    planner = createPlanner(table);
+    planner->initGlobalMap(1.0, localCellSize, offset, terrain.elevation, terrain.cost);
+    planner->setGoal(terrain.goal);
+    planner->calculateGlobalPropagation(terrain.start);
+    trajectory = planner->getNewPath(terrain.start);
+    planner->updateLocalMap(rover);
+
+    planner->localExpandableObstacles.clear();
+    start = base::Time::now();
+    planner->ingestTraversabilityMap(wPos, frame);
+    addSample(results, "ingestTraversabilityMap", size, ratioScale, seed, elapsed(start));
+
+    uint minIndex = planner->globalPath.size(), maxIndex = 0;
+    for (uint i = 0; i < planner->localExpandableObstacles.size(); i++)
+        planner->isBlockingObstacle(planner->localExpandableObstacles[i], maxIndex, minIndex);
+
+    start = base::Time::now();
+    planner->expandRisk();
+    addSample(results, "expandRisk", size, ratioScale, seed, elapsed(start));
+
+    if (minIndex < planner->globalPath.size())
+    {
+        start = base::Time::now();
+        planner->repairPath(trajectory, minIndex, maxIndex);
+        addSample(results, "repairPath", size, ratioScale, seed, elapsed(start));
+    }
+    destroyPlanner(planner, table);
+}
+
+// Frame k of a rover driving along x past world, width x height pixels
+// starting step*k columns in
+static void frameWindow(const base::samples::frame::Frame& world, uint width, uint height,
+                        uint column, base::samples::frame::Frame& frame)
+{
+    frame.init(width, height);
+    const uint8_t* source = world.getImageConstPtr();
+    uint8_t* image = frame.getImagePtr();
+    for (uint j = 0; j < height; j++)
+        std::copy(source + j*world.getWidth() + column,
+                  source + j*world.getWidth() + column + width, image + j*width);
+}
+
+static void runIngestionCase(uint frameSize, uint ratioScale, uint64_t seed, uint iteration,
+                             std::vector<benchmarkResult>& results)
+{
+  // Eight frames of frameSize pixels, each half a meter further along x
+  // than the previous one, ingested by a planner with full and one with
+  // delta ingestion. The first frame of each only builds the local maps
+    const uint mapSize = 256, frames = 8;
+    double localCellSize = 1.0/ratioScale;
+    uint step = ratioScale/2;
+    TerrainGenerator generator(seed + 7919*iteration);
+    syntheticTerrain terrain;
+    generator.generate(mapSize, 0.08*mapSize, 0.02, terrain);
+    base::samples::frame::Frame world, frame;
+    generator.obstacleFrame(frameSize + frames*step, frameSize, 0.002, ratioScale, world);
+    base::Waypoint centre;
+    centre.position[0] = 0.5*mapSize - 0.5*frames*step*localCellSize;
+    centre.position[1] = 0.5*mapSize;
+    base::Pose2D offset;
+
+    for (uint delta = 0; delta < 2; delta++)
+    {
+        std::vector<terrainType*> table;
+        PathPlanning* planner = createPlanner(table);
+        planner->initGlobalMap(1.0, localCellSize, offset, terrain.elevation, terrain.cost);
+        planner->setDeltaIngestion(delta == 1);
+        for (uint k = 0; k < frames; k++)
+        {
+            frameWindow(world, frameSize, frameSize, k*step, frame);
+            base::Waypoint wPos = framePose(centre, frameSize, frameSize, localCellSize);
+            wPos.position[0] += k*step*localCellSize;
+            planner->localExpandableObstacles.clear();
+            base::Time start = base::Time::now();
+            planner->ingestTraversabilityMap(wPos, frame);
+            double seconds = elapsed(start);
+            if (k > 0)
+                addSample(results, caseName(delta ? "ingestTraversabilityMap delta" :
+                                            "ingestTraversabilityMap full", "frame ", frameSize),
+                          mapSize, ratioScale, seed, seconds, "frames", 1);
+        }
+        destroyPlanner(planner, table);
+    }
+}
+
+static void addAgreement(std::vector<agreementResult>& results, const std::string& benchmark,
+                         uint size, uint ratioScale, uint64_t seed,
+                         PathPlanning* reference, PathPlanning* planner)
+{
+  // Risk of every local node of both planners, which saw the same frames
+    agreementResult* result = NULL;
+    for (uint k = 0; k < results.size(); k++)
+        if ((results[k].benchmark == benchmark)&&(results[k].size == size)&&
+            (results[k].ratioScale == ratioScale))
+            result = &results[k];
+    if (result == NULL)
+    {
+        agreementResult empty = {benchmark, size, ratioScale, seed, 0, 0, 0};
+        results.push_back(empty);
+        result = &results.back();
+    }
+    for (uint j = 0; j < size; j++)
+        for (uint i = 0; i < size; i++)
+        {
+            globalNode* a = reference->getGlobalNode(i, j);
+            globalNode* b = planner->getGlobalNode(i, j);
+            if ((!a->hasLocalMap)||(!b->hasLocalMap))
+                continue;
+            for (uint l = 0; l < ratioScale; l++)
+                for (uint k = 0; k < ratioScale; k++)
+                {
+                    double riskA = a->localMap[l][k]->risk, riskB = b->localMap[l][k]->risk;
+                    if ((riskA <= 0)&&(riskB <= 0))
+                        continue;
+                    double difference = fabs(riskA - riskB);
+                    result->nodes++;
+                    result->maxDifference = std::max(result->maxDifference, difference);
+                    result->sumDifference += difference;
+                }
+        }
+}
+
+static void runRiskCase(uint ratioScale, uint64_t seed, uint iteration,
+                        std::vector<benchmarkResult>& results,
+                        std::vector<agreementResult>& agreement)
+{
+  // A dense obstacle scene, a 20 m frame with one obstacle pixel in a
+  // hundred, expanded by both engines with 1, 2, 4 and 8 threads. The
+  // risk of each engine is compared with the single thread Eikonal field
+    const uint mapSize = 64;
+    const uint threadCounts[4] = {1, 2, 4, 8};
+    double localCellSize = 1.0/ratioScale;
+    uint frameSize = 20*ratioScale;
+    TerrainGenerator generator(seed + 7919*iteration);
+    syntheticTerrain terrain;
+    generator.generate(mapSize, 0.08*mapSize, 0.02, terrain);
+    base::samples::frame::Frame frame;
+    generator.obstacleFrame(frameSize, frameSize, 0.01, ratioScale, frame);
+    base::Waypoint centre;
+    centre.position[0] = 0.5*mapSize;
+    centre.position[1] = 0.5*mapSize;
+    base::Waypoint wPos = framePose(centre, frameSize, frameSize, localCellSize);
+    base::Pose2D offset;
+
+    std::vector<terrainType*> referenceTable;
+    PathPlanning* reference = NULL;
+    for (uint engine = 0; engine < 2; engine++)
+        for (uint t = 0; t < 4; t++)
+        {
+            std::vector<terrainType*> table;
+            PathPlanning* planner = createPlanner(table);
+            planner->initGlobalMap(1.0, localCellSize, offset, terrain.elevation, terrain.cost);
+            planner->setRiskEngine(engine ? RISK_DISTANCE_TRANSFORM : RISK_EIKONAL);
+            planner->setRiskThreads(threadCounts[t]);
+            planner->localExpandableObstacles.clear();
+            planner->ingestTraversabilityMap(wPos, frame);
+            double obstacles = planner->localExpandableObstacles.size();
+            base::Time start = base::Time::now();
+            planner->expandRisk();
+            addSample(results, caseName(engine ? "expandRisk distance_transform" :
+                                        "expandRisk eikonal", "threads ", threadCounts[t]),
+                      mapSize, ratioScale, seed, elapsed(start), "obstacles", obstacles);
+
+            if (reference == NULL)
+            {
+                reference = planner;
+                referenceTable = table;
+                continue;
+            }
+            addAgreement(agreement, caseName(engine ? "distance_transform vs eikonal" :
+                                             "eikonal vs eikonal", "threads ", threadCounts[t]),
+                         mapSize, ratioScale, seed, reference, planner);
+            destroyPlanner(planner, table);
+        }
+    destroyPlanner(reference, referenceTable);
+}
+
+static void addStatistics(std::vector<logResult>& results, const std::string& benchmark,
+                          uint size, uint ratioScale, uint64_t seed,
+                          const costMapLogStatistics& statistics)
+{
+    for (uint k = 0; k < results.size(); k++)
+        if ((results[k].benchmark == benchmark)&&(results[k].size == size)&&
+            (results[k].ratioScale == ratioScale))
+        {
+            costMapLogStatistics& sum = results[k].statistics;
+            sum.frames += statistics.frames;
+            sum.keyFrames += statistics.keyFrames;
+            sum.rawBytes += statistics.rawBytes;
+            sum.encodedBytes += statistics.encodedBytes;
+            sum.time += statistics.time;
+            return;
+        }
+    logResult result;
+    result.benchmark = benchmark;
+    result.size = size;
+    result.ratioScale = ratioScale;
+    result.seed = seed;
+    result.statistics = statistics;
+    results.push_back(result);
+}
+
+// Logs the frames and reads them back, adding the statistics of both
+static void measureLog(const std::vector<base::samples::DistanceImage>& frames, float precision,
+                       const std::string& map, uint size, uint ratioScale, uint64_t seed,
+                       std::vector<logResult>& results)
+{
+    std::ostringstream encoded;
+    CostMapLogWriter writer(encoded, precision);
+    for (uint f = 0; f < frames.size(); f++)
+        writer.write(frames[f]);
+    addStatistics(results, "CostMapLogWriter " + map, size, ratioScale, seed, writer.getStatistics());
+
+    std::istringstream stream(encoded.str());
+    CostMapLogReader reader(stream);
+    base::samples::DistanceImage image;
+    while (reader.read(image));
+    addStatistics(results, "CostMapLogReader " + map, size, ratioScale, seed, reader.getStatistics());
+}
+
+static void runLogCase(uint size, uint ratioScale, uint64_t seed, uint iteration,
+                       std::vector<logResult>& results)
+{
+    TerrainGenerator generator(seed + 7919*iteration);
+    syntheticTerrain terrain;
+    generator.generate(size, 0.08*size, 0.02, terrain);
+
+    double localCellSize = 1.0/ratioScale;
+    uint frameSize = 8*ratioScale;
+    base::samples::frame::Frame frame;
+    base::Pose2D offset;
+    std::vector<terrainType*> table;
+    PathPlanning* planner = createPlanner(table);
+    planner->initGlobalMap(1.0, localCellSize, offset, terrain.elevation, terrain.cost);
+    planner->setGoal(terrain.goal);
+    planner->calculateGlobalPropagation(terrain.start);
+    std::vector<base::Waypoint> trajectory = planner->getNewPath(terrain.start);
+    if (trajectory.size() < 2)
+    {
+        destroyPlanner(planner, table);
+        return;
+    }
+
+  // The rover stops at 8 points of the first half of the path, where it
+  // sees new obstacles and propagates the global field again
+    std::vector<base::samples::DistanceImage> totalCost, risk;
+    mapExport totalCostExport, riskExport;
+    for (uint f = 0; f < 8; f++)
+    {
+        base::Waypoint rover = trajectory[f*(trajectory.size()/2)/8];
+        generator.obstacleFrame(frameSize, frameSize, 0.002, ratioScale, frame);
+        planner->updateLocalMap(rover);
+        planner->localExpandableObstacles.clear();
+        planner->ingestTraversabilityMap(framePose(rover, frameSize, frameSize, localCellSize), frame);
+        planner->expandRisk();
+        planner->calculateGlobalPropagation(rover);
+        planner->exportGlobalTotalCostMap(totalCostExport);
+        planner->exportLocalRiskMap(rover, riskExport);
+        totalCost.push_back(totalCostExport.image);
+        risk.push_back(riskExport.image);
+    }
+    destroyPlanner(planner, table);
+
+    measureLog(totalCost, 0.001, "total_cost", size, ratioScale, seed, results);
+    measureLog(risk, 1, "risk", size, ratioScale, seed, results);
+}
+
+static void writeResult(std::ostream& out, const benchmarkResult& result)
+{
+    std::vector<double> sorted = result.samples;
+    std::sort(sorted.begin(), sorted.end());
+    double sum = 0;
+    for (uint k = 0; k < sorted.size(); k++)
+        sum += sorted[k];
+    out << "{\"benchmark\": \"" << result.phase << "\""
+        << ", \"size\": " << result.size
+        << ", \"ratio_scale\": " << result.ratioScale
+        << ", \"seed\": " << result.seed
+        << ", \"iterations\": " << sorted.size()
+        << ", \"min_s\": " << sorted.front()
+        << ", \"median_s\": " << sorted[sorted.size()/2]
+        << ", \"mean_s\": " << sum/sorted.size()
+        << ", \"max_s\": " << sorted.back();
+    if (!result.rateName.empty())
+        out << ", \"" << result.rateName << "_per_s\": " << ((sum > 0) ? result.rateCount/sum : 0);
+    out << "}" << std::endl;
+}
+
+static void writeAgreement(std::ostream& out, const agreementResult& result)
+{
+    out << "{\"benchmark\": \"" << result.benchmark << "\""
+        << ", \"size\": " << result.size
+        << ", \"ratio_scale\": " << result.ratioScale
+        << ", \"seed\": " << result.seed
+        << ", \"risky_nodes\": " << result.nodes
+        << ", \"max_difference\": " << result.maxDifference
+        << ", \"mean_difference\": " << ((result.nodes > 0) ? result.sumDifference/result.nodes : 0)
+        << "}" << std::endl;
+}
+
+static void writeLogResult(std::ostream& out, const logResult& result)
+{
+    out << "{\"benchmark\": \"" << result.benchmark << "\""
+        << ", \"size\": " << result.size
+        << ", \"ratio_scale\": " << result.ratioScale
+        << ", \"seed\": " << result.seed
+        << ", \"frames\": " << result.statistics.frames
+        << ", \"key_frames\": " << result.statistics.keyFrames
+        << ", \"ratio\": " << result.statistics.ratio()
+        << ", \"mb_per_s\": " << result.statistics.throughput() << "}" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    std::string outputName = (argc > 1) ? argv[1] : "path_planning_benchmark.jsonl";
+    uint iterations = (argc > 2) ? (uint)atoi(argv[2]) : 5;
+    uint64_t seed = (argc > 3) ? strtoull(argv[3], NULL, 10) : 1;
+    if (iterations == 0)
+        iterations = 1;
+
+    std::ofstream output(outputName.c_str());
+    if (!output)
+    {
+        std::cerr << "BENCHMARK: cannot write " << outputName << std::endl;
+        return 1;
+    }
+    output.precision(9);
+
+    const uint sizes[3] = {64, 128, 256};
+    const uint ratioScales[2] = {5, 10};
+    const uint frameSizes[2] = {512, 1024};
+    std::vector<benchmarkResult> results;
+    std::vector<agreementResult> agreement;
+    std::vector<logResult> logResults;
+    setLogLevel(LOG_LEVEL_NONE);
+    for (uint s = 0; s < 3; s++)
+        for (uint r = 0; r < 2; r++)
+        {
+            for (uint k = 0; k < iterations; k++)
+            {
+                runCase(sizes[s], ratioScales[r], seed, k, results);
+                runLogCase(sizes[s], ratioScales[r], seed, k, logResults);
+            }
+            std::cerr << "BENCHMARK: size " << sizes[s] << ", ratio_scale "
+                      << ratioScales[r] << " done" << std::endl;
+        }
+    for (uint r = 0; r < 2; r++)
+    {
+        for (uint k = 0; k < iterations; k++)
+        {
+            for (uint f = 0; f < 2; f++)
+                runIngestionCase(frameSizes[f], ratioScales[r], seed, k, results);
+            runRiskCase(ratioScales[r], seed, k, results, agreement);
+        }
+        std::cerr << "BENCHMARK: ingestion and risk engines, ratio_scale "
+                  << ratioScales[r] << " done" << std::endl;
+    }
+
+    for (uint k = 0; k < results.size(); k++)
+    {
+        writeResult(output, results[k]);
+        std::sort(results[k].samples.begin(), results[k].samples.end());
+        std::cerr << "BENCHMARK: " << results[k].phase << " size " << results[k].size
+                  << " ratio_scale " << results[k].ratioScale << " median "
+                  << results[k].samples[results[k].samples.size()/2] << " s" << std::endl;
+    }
+    for (uint k = 0; k < agreement.size(); k++)
+    {
+        writeAgreement(output, agreement[k]);
+        std::cerr << "BENCHMARK: " << agreement[k].benchmark << " ratio_scale "
+                  << agreement[k].ratioScale << " max difference "
+                  << agreement[k].maxDifference << std::endl;
+    }
+    for (uint k = 0; k < logResults.size(); k++)
+    {
+        writeLogResult(output, logResults[k]);
+        std::cerr << "BENCHMARK: " << logResults[k].benchmark << " size " << logResults[k].size
+                  << " ratio_scale " << logResults[k].ratioScale << " ratio "
+                  << logResults[k].statistics.ratio() << ", "
+                  << logResults[k].statistics.throughput() << " MB/s" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,137 @@
+#include "TerrainGenerator.hpp"
+#include <math.h>
+#include <algorithm>
+
+using namespace PathPlanning_lib;
+
+TerrainGenerator::TerrainGenerator(uint64_t seed)
+{
+    state = seed*0x9E3779B97F4A7C15ULL + 1;
+}
+
+double TerrainGenerator::uniform()
+{
+  // xorshift64*
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return ((state*0x2545F4914F6CDD1DULL) >> 11)*(1.0/9007199254740992.0);
+}
+
+void TerrainGenerator::fractal(uint size, double roughness, std::vector<double>& field)
+{
+  // Diamond-square on the smallest 2^k+1 grid covering size, normalized to
+  // [0,1] and cropped to size x size
+    uint n = 1;
+    while (n + 1 < size)
+        n *= 2;
+    uint side = n + 1;
+    std::vector<double> grid(side*side, 0);
+    grid[0] = uniform();
+    grid[n] = uniform();
+    grid[n*side] = uniform();
+    grid[n*side + n] = uniform();
+    double amplitude = 1;
+    for (uint step = n; step > 1; step /= 2)
+    {
+        uint half = step/2;
+        for (uint y = half; y < side; y += step)
+            for (uint x = half; x < side; x += step)
+                grid[y*side + x] = 0.25*(grid[(y-half)*side + x-half] + grid[(y-half)*side + x+half] +
+                                         grid[(y+half)*side + x-half] + grid[(y+half)*side + x+half]) +
+                                   amplitude*(uniform() - 0.5);
+        for (uint y = 0; y < side; y += half)
+            for (uint x = (y/half % 2 == 0) ? half : 0; x < side; x += step)
+            {
+                double sum = 0;
+                uint count = 0;
+                if (y >= half) { sum += grid[(y-half)*side + x]; count++; }
+                if (y + half < side) { sum += grid[(y+half)*side + x]; count++; }
+                if (x >= half) { sum += grid[y*side + x-half]; count++; }
+                if (x + half < side) { sum += grid[y*side + x+half]; count++; }
+                grid[y*side + x] = sum/count + amplitude*(uniform() - 0.5);
+            }
+        amplitude *= roughness;
+    }
+
+    field.resize(size*size);
+    for (uint y = 0; y < size; y++)
+        for (uint x = 0; x < size; x++)
+            field[y*size + x] = grid[y*side + x];
+    double minValue = *std::min_element(field.begin(), field.end());
+    double maxValue = *std::max_element(field.begin(), field.end());
+    for (uint i = 0; i < field.size(); i++)
+        field[i] = (maxValue > minValue) ? (field[i] - minValue)/(maxValue - minValue) : 0;
+}
+
+void TerrainGenerator::clearDisc(syntheticTerrain& terrain, const base::Waypoint& centre, int radius)
+{
+    for (int dy = -radius; dy <= radius; dy++)
+        for (int dx = -radius; dx <= radius; dx++)
+        {
+            int x = (int)centre.position[0] + dx;
+            int y = (int)centre.position[1] + dy;
+            if ((x >= 0)&&(y >= 0)&&(x < (int)terrain.size)&&(y < (int)terrain.size)&&
+                (dx*dx + dy*dy <= radius*radius))
+                terrain.cost[y][x] = 1;
+        }
+}
+
+void TerrainGenerator::generate(uint size, double relief, double obstacleDensity,
+                                syntheticTerrain& terrain)
+{
+  // Fractal elevation of relief meters, two terrain classes from a second
+  // fractal and discs of obstacle class scattered with obstacleDensity.
+  // Start and goal sit near opposite corners on cleared ground
+    terrain.size = size;
+    std::vector<double> height, classes;
+    fractal(size, 0.55, height);
+    fractal(size, 0.6, classes);
+    terrain.elevation.assign(size, std::vector<double>(size, 0));
+    terrain.cost.assign(size, std::vector<double>(size, 1));
+    for (uint j = 0; j < size; j++)
+        for (uint i = 0; i < size; i++)
+        {
+            terrain.elevation[j][i] = relief*height[j*size + i];
+            terrain.cost[j][i] = (classes[j*size + i] > 0.6) ? 2 : 1;
+        }
+
+    uint discs = (uint)(obstacleDensity*size*size/12.0);
+    for (uint k = 0; k < discs; k++)
+    {
+        int cx = (int)(uniform()*size);
+        int cy = (int)(uniform()*size);
+        int radius = 1 + (int)(uniform()*2);
+        for (int dy = -radius; dy <= radius; dy++)
+            for (int dx = -radius; dx <= radius; dx++)
+                if ((cx+dx >= 0)&&(cy+dy >= 0)&&(cx+dx < (int)size)&&(cy+dy < (int)size)&&
+                    (dx*dx + dy*dy <= radius*radius))
+                    terrain.cost[cy+dy][cx+dx] = 0;
+    }
+
+    terrain.start.position[0] = 0.1*size;
+    terrain.start.position[1] = 0.1*size;
+    terrain.start.heading = 0;
+    terrain.goal.position[0] = 0.9*size;
+    terrain.goal.position[1] = 0.85*size;
+    terrain.goal.heading = 0;
+    clearDisc(terrain, terrain.start, 3);
+    clearDisc(terrain, terrain.goal, 3);
+}
+
+void TerrainGenerator::obstacleFrame(uint width, uint height, double obstacleDensity,
+                                     uint blockRadius, base::samples::frame::Frame& frame)
+{
+  // Grayscale traversability frame, 255 traversable and 0 obstacle, with a
+  // disc of blockRadius pixels at the center and random obstacle pixels
+    frame.init(width, height);
+    uint8_t* image = frame.getImagePtr();
+    int cx = width/2, cy = height/2, r = blockRadius;
+    for (uint j = 0; j < height; j++)
+        for (uint i = 0; i < width; i++)
+        {
+            int dx = (int)i - cx, dy = (int)j - cy;
+            bool isObstacle = (dx*dx + dy*dy <= r*r)||(uniform() < obstacleDensity);
+            image[j*width + i] = isObstacle ? 0 : 255;
+        }
+}
@@ -0,0 +1,42 @@
+#ifndef _PATHPLANNING_TERRAIN_GENERATOR_HPP_
+#define _PATHPLANNING_TERRAIN_GENERATOR_HPP_
+
+#include <base/samples/Frame.hpp>
+#include <base/Waypoint.hpp>
+#include <vector>
+#include <stdint.h>
+
+namespace PathPlanning_lib
+{
+    struct syntheticTerrain
+    {
+        uint size; //Global nodes per side
+        std::vector< std::vector<double> > elevation; //Meters, [j][i] as initGlobalMap
+        std::vector< std::vector<double> > cost; //Terrain class, 0 is obstacle
+        base::Waypoint start; //Global Units, kept clear of obstacles
+        base::Waypoint goal;
+    };
+
+    // Every terrain and frame only depends on the seed, the generator does
+    // not use the C library or std random engines so the benchmarks are the
+    // same on every platform
+    class TerrainGenerator
+    {
+        private:
+            uint64_t state;
+
+            double uniform(); //In [0,1)
+            void fractal(uint size, double roughness, std::vector<double>& field);
+            void clearDisc(syntheticTerrain& terrain, const base::Waypoint& centre, int radius);
+        public:
+            TerrainGenerator(uint64_t seed);
+
+            void generate(uint size, double relief, double obstacleDensity,
+                          syntheticTerrain& terrain);
+            void obstacleFrame(uint width, uint height, double obstacleDensity,
+                               uint blockRadius, base::samples::frame::Frame& frame);
+    };
+
+} // end namespace PathPlanning_lib
+
+#endif // _PATHPLANNING_TERRAIN_GENERATOR_HPP_
@@ -0,0 +1,329 @@
+#include "CostMapLog.hpp"
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace PathPlanning_lib;
+
+static const char logMagic[4] = {'C','M','L','G'};
+static const uint8_t logVersion = 1;
+
+// Quantized values are kept below 2^53 so that they round trip through double
+static const double maxQuantized = 9007199254740992.0;
+
+// Width, height and time varints plus the five floats of a payload
+static const uint64_t maxPayloadHeader = 3 + 3 + 10 + 5*4;
+
+// Largest payload write can produce for an image of pixels: at most one
+// pair of run lengths and one residual per pixel, 10 bytes per varint
+static uint64_t maxPayloadSize(uint64_t pixels)
+{
+    return maxPayloadHeader + 3*10*pixels;
+}
+
+static void putVarint(std::vector<uint8_t>& out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((uint8_t)value);
+}
+
+static bool getVarint(const std::vector<uint8_t>& in, size_t& pos, uint64_t& value)
+{
+    value = 0;
+    for (uint shift = 0; shift < 64; shift += 7)
+    {
+        if (pos >= in.size())
+            return false;
+        uint8_t byte = in[pos++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static void putFloat(std::vector<uint8_t>& out, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    for (uint i = 0; i < 4; i++)
+        out.push_back((uint8_t)(bits >> 8*i));
+}
+
+static bool getFloat(const std::vector<uint8_t>& in, size_t& pos, float& value)
+{
+    if (pos + 4 > in.size())
+        return false;
+    uint32_t bits = 0;
+    for (uint i = 0; i < 4; i++)
+        bits |= (uint32_t)in[pos++] << 8*i;
+    memcpy(&value, &bits, 4);
+    return true;
+}
+
+// Median edge predictor (LOCO-I) from the left, upper and upper left
+// pixels, exact on planes, so smooth cost ramps leave small residuals
+static int64_t predictPixel(const std::vector<int64_t>& v, uint i, uint width)
+{
+    uint x = i % width;
+    if (i < width)
+        return (x > 0) ? v[i-1] : 0;
+    if (x == 0)
+        return v[i-width];
+    int64_t a = v[i-1], b = v[i-width], c = v[i-width-1];
+    if (c >= std::max(a,b))
+        return std::min(a,b);
+    if (c <= std::min(a,b))
+        return std::max(a,b);
+    return a + b - c;
+}
+
+int64_t PathPlanning_lib::quantizeCost(float value, float precision)
+{
+  // NaN is logged as 0, anything beyond the representable range saturates
+    double q = (double)value/precision;
+    if (!(q == q))
+        return 0;
+    q = fmax(-maxQuantized, fmin(maxQuantized, q));
+    return (int64_t)llround(q);
+}
+
+double costMapLogStatistics::ratio() const
+{
+    return (encodedBytes > 0) ? (double)rawBytes/encodedBytes : 0;
+}
+
+double costMapLogStatistics::throughput() const
+{
+    return (time > 0) ? rawBytes/time*1e-6 : 0;
+}
+
+
+CostMapLogWriter::CostMapLogWriter(std::ostream& _stream, float _precision,
+                                   uint _keyFrameInterval):
+                                   stream(_stream), precision(_precision),
+                                   keyFrameInterval(_keyFrameInterval)
+{
+    framesSinceKey = 0;
+    hasHeader = false;
+}
+
+void CostMapLogWriter::setPrecision(float _precision)
+{
+  // The next frame is a key frame, deltas need the same quantization
+    precision = _precision;
+    previous.clear();
+}
+
+bool CostMapLogWriter::isKeyFrameNeeded(const base::samples::DistanceImage& image)
+{
+    return (previous.size() != image.data.size())||
+           (framesSinceKey + 1 >= keyFrameInterval)||
+           (image.width != previousFrame.width)||
+           (image.height != previousFrame.height)||
+           (image.scale_x != previousFrame.scale_x)||
+           (image.scale_y != previousFrame.scale_y)||
+           (image.center_x != previousFrame.center_x)||
+           (image.center_y != previousFrame.center_y);
+}
+
+bool CostMapLogWriter::write(const base::samples::DistanceImage& image)
+{
+    base::Time tEncode = base::Time::now();
+    if (!hasHeader)
+    {
+        stream.write(logMagic, 4);
+        stream.put((char)logVersion);
+        hasHeader = true;
+    }
+
+    uint n = image.width*image.height;
+    if ((precision <= 0)||(image.data.size() < n))
+        return false;
+    bool isKeyFrame = isKeyFrameNeeded(image);
+
+    payload.clear();
+    putVarint(payload, image.width);
+    putVarint(payload, image.height);
+    putVarint(payload, zigzag(image.time.toMicroseconds()));
+    putFloat(payload, precision);
+    putFloat(payload, image.scale_x);
+    putFloat(payload, image.scale_y);
+    putFloat(payload, image.center_x);
+    putFloat(payload, image.center_y);
+
+    current.resize(n);
+    for (uint i = 0; i < n; i++)
+        current[i] = quantizeCost(image.data[i], precision);
+
+  // Key frames code the quantized values, delta frames their change since
+  // the previous frame, both against predictPixel
+    values.resize(n);
+    for (uint i = 0; i < n; i++)
+        values[i] = isKeyFrame ? current[i] : current[i] - previous[i];
+
+    residuals.resize(n);
+    for (uint i = 0; i < n; i++)
+        residuals[i] = values[i] - predictPixel(values, i, image.width);
+
+  // Residuals as alternating runs of zeros and literals
+    uint i = 0;
+    while (i < n)
+    {
+        uint runStart = i;
+        while ((i < n)&&(residuals[i] == 0))
+            i++;
+        putVarint(payload, i - runStart);
+        uint literalStart = i;
+        while ((i < n)&&(residuals[i] != 0))
+            i++;
+        putVarint(payload, i - literalStart);
+        for (uint k = literalStart; k < i; k++)
+            putVarint(payload, zigzag(residuals[k]));
+    }
+
+    std::vector<uint8_t> frameHeader;
+    frameHeader.push_back(isKeyFrame ? COST_MAP_KEY_FRAME : COST_MAP_DELTA_FRAME);
+    putVarint(frameHeader, payload.size());
+    stream.write((const char*)&frameHeader[0], frameHeader.size());
+    stream.write((const char*)&payload[0], payload.size());
+
+    previous.swap(current);
+    previousFrame.width = image.width;
+    previousFrame.height = image.height;
+    previousFrame.scale_x = image.scale_x;
+    previousFrame.scale_y = image.scale_y;
+    previousFrame.center_x = image.center_x;
+    previousFrame.center_y = image.center_y;
+    framesSinceKey = isKeyFrame ? 0 : framesSinceKey + 1;
+
+    statistics.frames++;
+    if (isKeyFrame)
+        statistics.keyFrames++;
+    statistics.rawBytes += n*sizeof(float);
+    statistics.encodedBytes += frameHeader.size() + payload.size();
+    statistics.time += (base::Time::now() - tEncode).toSeconds();
+    return stream.good();
+}
+
+costMapLogStatistics CostMapLogWriter::getStatistics()
+{
+    return statistics;
+}
+
+
+CostMapLogReader::CostMapLogReader(std::istream& _stream):
+                                   stream(_stream)
+{
+    hasHeader = false;
+}
+
+bool CostMapLogReader::read(base::samples::DistanceImage& image)
+{
+  // False at the end of the stream or on a malformed frame
+    base::Time tDecode = base::Time::now();
+    if (!hasHeader)
+    {
+        char magic[4];
+        if (!stream.read(magic, 4) || (memcmp(magic, logMagic, 4) != 0) ||
+            (stream.get() != logVersion))
+            return false;
+        hasHeader = true;
+    }
+
+    int type = stream.get();
+    if ((type != COST_MAP_KEY_FRAME)&&(type != COST_MAP_DELTA_FRAME))
+        return false;
+    uint64_t size = 0;
+    uint frameHeader = 1;
+    for (uint shift = 0; ; shift += 7)
+    {
+        int byte = stream.get();
+        frameHeader++;
+        if ((byte < 0)||(shift >= 64))
+            return false;
+        size |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+
+  // The payload header comes first, the size is checked against the
+  // largest frame of its width and height before the rest is read
+    uint64_t headerSize = std::min(size, maxPayloadHeader);
+    payload.resize(headerSize);
+    if ((headerSize > 0)&&(!stream.read((char*)&payload[0], headerSize)))
+        return false;
+
+    size_t pos = 0;
+    uint64_t width, height, time;
+    float precision;
+    if (!getVarint(payload, pos, width) || !getVarint(payload, pos, height) ||
+        !getVarint(payload, pos, time) || (width > 0xffff) || (height > 0xffff) ||
+        !getFloat(payload, pos, precision) ||
+        !getFloat(payload, pos, image.scale_x) || !getFloat(payload, pos, image.scale_y) ||
+        !getFloat(payload, pos, image.center_x) || !getFloat(payload, pos, image.center_y))
+        return false;
+    if (size > maxPayloadSize(width*height))
+        return false;
+    payload.resize(size);
+    if ((size > headerSize)&&(!stream.read((char*)&payload[headerSize], size - headerSize)))
+        return false;
+    image.time = base::Time::fromMicroseconds(unzigzag(time));
+
+    uint n = width*height;
+    bool isKeyFrame = (type == COST_MAP_KEY_FRAME);
+    if (!isKeyFrame && (previous.size() != n))
+        return false;
+    previous.resize(n);
+    image.setSize(width, height);
+
+    values.resize(n);
+    uint i = 0;
+    uint64_t zeros, literals, residual;
+    while (i < n)
+    {
+        if (!getVarint(payload, pos, zeros) || (zeros > n - i))
+            return false;
+        for (uint64_t k = 0; k < zeros; k++, i++)
+            values[i] = predictPixel(values, i, width);
+        if (!getVarint(payload, pos, literals) || (literals > n - i))
+            return false;
+        for (uint64_t k = 0; k < literals; k++, i++)
+        {
+            if (!getVarint(payload, pos, residual))
+                return false;
+            values[i] = predictPixel(values, i, width) + unzigzag(residual);
+        }
+    }
+    for (i = 0; i < n; i++)
+        previous[i] = isKeyFrame ? values[i] : previous[i] + values[i];
+    for (i = 0; i < n; i++)
+        image.data[i] = previous[i]*(double)precision;
+
+    statistics.frames++;
+    if (isKeyFrame)
+        statistics.keyFrames++;
+    statistics.rawBytes += n*sizeof(float);
+    statistics.encodedBytes += frameHeader + size;
+    statistics.time += (base::Time::now() - tDecode).toSeconds();
+    return true;
+}
+
+costMapLogStatistics CostMapLogReader::getStatistics()
+{
+    return statistics;
+}
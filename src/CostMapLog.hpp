@@ -0,0 +1,93 @@
+#ifndef _PATHPLANNING_COST_MAP_LOG_HPP_
+#define _PATHPLANNING_COST_MAP_LOG_HPP_
+
+#include <base/samples/DistanceImage.hpp>
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+
+namespace PathPlanning_lib
+{
+    // Stream layout, all integers are LEB128 varints unless stated:
+    //   header: "CMLG", version byte
+    //   frame:  type byte ('K' key frame, 'D' delta frame), payload size,
+    //           payload
+    //   payload: width, height, zigzag time in us, precision, scale_x,
+    //            scale_y, center_x, center_y (little endian floats), then
+    //            the residuals as runs: zero run length, literal count,
+    //            literal zigzag residuals, until width*height are covered
+    // Pixels are quantized to round(value/precision). A key frame codes the
+    // quantized pixels, a delta frame their difference with the previous
+    // frame, in both cases as the residual of a median edge predictor
+    enum cost_map_frame
+    {
+        COST_MAP_KEY_FRAME = 'K',
+        COST_MAP_DELTA_FRAME = 'D'
+    };
+
+    struct costMapLogStatistics
+    {
+        uint64_t frames;
+        uint64_t keyFrames;
+        uint64_t rawBytes; //Size of the float images
+        uint64_t encodedBytes; //Size of the frames in the stream
+        double time; //Seconds spent encoding or decoding
+        costMapLogStatistics()
+        {
+            frames = 0;
+            keyFrames = 0;
+            rawBytes = 0;
+            encodedBytes = 0;
+            time = 0;
+        }
+        double ratio() const; //rawBytes/encodedBytes
+        double throughput() const; //Raw MB per second
+    };
+
+    class CostMapLogWriter
+    {
+        private:
+            std::ostream& stream;
+            float precision; //Quantization step, in units of the image
+            uint keyFrameInterval; //A key frame every this many frames
+            uint framesSinceKey;
+            bool hasHeader;
+            base::samples::DistanceImage previousFrame; //Geometry of the last frame
+            std::vector<int64_t> previous; //Quantized last frame
+            std::vector<int64_t> current;
+            std::vector<int64_t> values; //Coded values, see write
+            std::vector<int64_t> residuals;
+            std::vector<uint8_t> payload;
+            costMapLogStatistics statistics;
+
+            bool isKeyFrameNeeded(const base::samples::DistanceImage& image);
+        public:
+            CostMapLogWriter(std::ostream& _stream, float _precision,
+                             uint _keyFrameInterval = 30);
+
+            bool write(const base::samples::DistanceImage& image);
+            void setPrecision(float _precision);
+            costMapLogStatistics getStatistics();
+    };
+
+    class CostMapLogReader
+    {
+        private:
+            std::istream& stream;
+            bool hasHeader;
+            std::vector<int64_t> previous; //Quantized last frame
+            std::vector<int64_t> values;
+            std::vector<uint8_t> payload;
+            costMapLogStatistics statistics;
+        public:
+            CostMapLogReader(std::istream& _stream);
+
+            bool read(base::samples::DistanceImage& image);
+            costMapLogStatistics getStatistics();
+    };
+
+    int64_t quantizeCost(float value, float precision);
+
+} // end namespace PathPlanning_lib
+
+#endif // _PATHPLANNING_COST_MAP_LOG_HPP_
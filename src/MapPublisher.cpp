@@ -0,0 +1,320 @@
+#include "MapPublisher.hpp"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <new>
+
+using namespace PathPlanning_lib;
+
+static const char segmentMagic[8] = {'P','P','M','A','P','S','H','M'};
+static const uint32_t segmentVersion = 1;
+
+// Slots start on their own cache lines
+static size_t alignLine(size_t bytes)
+{
+    return (bytes + 63) & ~(size_t)63;
+}
+
+static mapSlotHeader* slotAt(uint8_t* segment, const mapSegmentHeader* header, uint64_t publication)
+{
+    return (mapSlotHeader*)(segment + alignLine(sizeof(mapSegmentHeader)) +
+                            (publication % header->slotCount)*header->slotStride);
+}
+
+
+MapPublisher::MapPublisher(std::string _name):
+                           name(_name)
+{
+    fd = -1;
+    segment = NULL;
+    segmentSize = 0;
+    header = NULL;
+    writing = NULL;
+    writingSequence = 0;
+}
+
+MapPublisher::~MapPublisher()
+{
+    close(false);
+}
+
+bool MapPublisher::create(uint slotCount, uint64_t slotCapacity)
+{
+  // An existing segment of the same name is unlinked and a new one created
+  // in its place. Resizing it instead would make subscribers still mapping
+  // it fault on the truncated pages, this way they keep the old segment
+  // until they open again
+    close(false);
+    if (slotCount < 2)
+        slotCount = 2;
+    uint64_t slotStride = alignLine(sizeof(mapSlotHeader)) + alignLine(slotCapacity*sizeof(float));
+    segmentSize = alignLine(sizeof(mapSegmentHeader)) + slotCount*slotStride;
+
+    shm_unlink(name.c_str());
+    fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+        return false;
+    void* address = MAP_FAILED;
+    if (ftruncate(fd, segmentSize) == 0)
+        address = mmap(NULL, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED)
+    {
+        ::close(fd);
+        fd = -1;
+        shm_unlink(name.c_str());
+        return false;
+    }
+    segment = (uint8_t*)address;
+
+  // The magic is written last, readers ignore a segment being initialized
+    header = (mapSegmentHeader*)segment;
+    memset(header->magic, 0, sizeof(header->magic));
+    header->version = segmentVersion;
+    header->slotCount = slotCount;
+    header->slotCapacity = slotCapacity;
+    header->slotStride = slotStride;
+    new (&header->published) std::atomic<uint64_t>(0);
+    for (uint s = 0; s < slotCount; s++)
+    {
+        mapSlotHeader* slot = slotAt(segment, header, s);
+        new (&slot->sequence) std::atomic<uint64_t>(0);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(header->magic, segmentMagic, sizeof(segmentMagic));
+    return true;
+}
+
+void MapPublisher::close(bool unlink)
+{
+    if (segment != NULL)
+        munmap(segment, segmentSize);
+    if (fd >= 0)
+        ::close(fd);
+    if (unlink && (fd >= 0))
+        shm_unlink(name.c_str());
+    segment = NULL;
+    header = NULL;
+    writing = NULL;
+    fd = -1;
+}
+
+float* MapPublisher::beginPublish(map_content content, uint width, uint height)
+{
+  // Returns where the width*height floats of the payload go, NULL if they
+  // do not fit. Nothing is visible to readers until endPublish
+    if ((header == NULL)||((uint64_t)width*height > header->slotCapacity))
+        return NULL;
+    writingSequence = header->published.load(std::memory_order_relaxed);
+    writing = slotAt(segment, header, writingSequence);
+    writing->sequence.store(2*writingSequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    writing->content = content;
+    writing->width = width;
+    writing->height = height;
+    writing->scale_x = 1;
+    writing->scale_y = 1;
+    writing->center_x = 0;
+    writing->center_y = 0;
+    writing->time = 0;
+    return (float*)((uint8_t*)writing + alignLine(sizeof(mapSlotHeader)));
+}
+
+mapSlotHeader* MapPublisher::getWritingHeader()
+{
+    return writing;
+}
+
+void MapPublisher::endPublish()
+{
+    if (writing == NULL)
+        return;
+    writing->sequence.store(2*writingSequence + 2, std::memory_order_release);
+    header->published.store(writingSequence + 1, std::memory_order_release);
+    writing = NULL;
+}
+
+bool MapPublisher::publish(const base::samples::DistanceImage& image)
+{
+    float* data = beginPublish(MAP_IMAGE, image.width, image.height);
+    if (data == NULL)
+        return false;
+    writing->scale_x = image.scale_x;
+    writing->scale_y = image.scale_y;
+    writing->center_x = image.center_x;
+    writing->center_y = image.center_y;
+    writing->time = image.time.toMicroseconds();
+    memcpy(data, &image.data[0], (size_t)image.width*image.height*sizeof(float));
+    endPublish();
+    return true;
+}
+
+bool MapPublisher::publish(const std::vector<base::Waypoint>& path, base::Time time)
+{
+    float* data = beginPublish(MAP_PATH, path.size(), 4);
+    if (data == NULL)
+        return false;
+    writing->time = time.toMicroseconds();
+    for (uint i = 0; i < path.size(); i++)
+    {
+        data[4*i] = path[i].position[0];
+        data[4*i+1] = path[i].position[1];
+        data[4*i+2] = path[i].position[2];
+        data[4*i+3] = path[i].heading;
+    }
+    endPublish();
+    return true;
+}
+
+uint64_t MapPublisher::getPublished()
+{
+    return (header != NULL) ? header->published.load(std::memory_order_relaxed) : 0;
+}
+
+
+MapSubscriber::MapSubscriber(std::string _name):
+                             name(_name)
+{
+    fd = -1;
+    segment = NULL;
+    segmentSize = 0;
+    header = NULL;
+}
+
+MapSubscriber::~MapSubscriber()
+{
+    close();
+}
+
+bool MapSubscriber::open()
+{
+  // False while the segment does not exist or is still being created
+    close();
+    fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        return false;
+    struct stat status;
+    void* address = MAP_FAILED;
+    if ((fstat(fd, &status) == 0)&&(status.st_size >= (off_t)sizeof(mapSegmentHeader)))
+        address = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED)
+    {
+        close();
+        return false;
+    }
+    segment = (uint8_t*)address;
+    segmentSize = status.st_size;
+    header = (const mapSegmentHeader*)segment;
+    bool isReady = (memcmp(header->magic, segmentMagic, sizeof(segmentMagic)) == 0);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if ((!isReady)||(header->version != segmentVersion)||(header->slotCount == 0)||
+        (alignLine(sizeof(mapSegmentHeader)) + header->slotCount*header->slotStride > segmentSize))
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MapSubscriber::close()
+{
+    if (segment != NULL)
+        munmap(segment, segmentSize);
+    if (fd >= 0)
+        ::close(fd);
+    segment = NULL;
+    header = NULL;
+    fd = -1;
+}
+
+bool MapSubscriber::view(mapView& latest)
+{
+  // The latest complete publication, read in place. It stays valid until
+  // slotCount newer ones have been started, which isValid tells
+    if (header == NULL)
+        return false;
+    uint64_t published = header->published.load(std::memory_order_acquire);
+    if (published == 0)
+        return false;
+    const mapSlotHeader* slot = slotAt(segment, header, published - 1);
+    uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+    if (sequence != 2*published)
+        return false;
+    latest.header = slot;
+    latest.data = (const float*)((const uint8_t*)slot + alignLine(sizeof(mapSlotHeader)));
+    latest.sequence = sequence;
+    return true;
+}
+
+bool MapSubscriber::isValid(const mapView& latest)
+{
+    if (latest.header == NULL)
+        return false;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return latest.header->sequence.load(std::memory_order_relaxed) == latest.sequence;
+}
+
+bool MapSubscriber::read(base::samples::DistanceImage& image, uint retries)
+{
+  // Copy of the latest image, retried while the planner overwrites it
+    mapView latest;
+    for (uint attempt = 0; attempt <= retries; attempt++)
+    {
+        if (!view(latest))
+            continue;
+        const mapSlotHeader* slot = latest.header;
+        uint width = slot->width, height = slot->height;
+        if ((slot->content != MAP_IMAGE)||((uint64_t)width*height > header->slotCapacity))
+        {
+            if (isValid(latest))
+                return false;
+            continue;
+        }
+        image.setSize(width, height);
+        image.scale_x = slot->scale_x;
+        image.scale_y = slot->scale_y;
+        image.center_x = slot->center_x;
+        image.center_y = slot->center_y;
+        image.time = base::Time::fromMicroseconds(slot->time);
+        memcpy(&image.data[0], latest.data, (size_t)width*height*sizeof(float));
+        if (isValid(latest))
+            return true;
+    }
+    return false;
+}
+
+bool MapSubscriber::read(std::vector<base::Waypoint>& path, uint retries)
+{
+    mapView latest;
+    for (uint attempt = 0; attempt <= retries; attempt++)
+    {
+        if (!view(latest))
+            continue;
+        const mapSlotHeader* slot = latest.header;
+        uint count = slot->width;
+        if ((slot->content != MAP_PATH)||(slot->height != 4)||
+            (4*(uint64_t)count > header->slotCapacity))
+        {
+            if (isValid(latest))
+                return false;
+            continue;
+        }
+        path.resize(count);
+        for (uint i = 0; i < count; i++)
+        {
+            path[i].position[0] = latest.data[4*i];
+            path[i].position[1] = latest.data[4*i+1];
+            path[i].position[2] = latest.data[4*i+2];
+            path[i].heading = latest.data[4*i+3];
+        }
+        if (isValid(latest))
+            return true;
+    }
+    return false;
+}
+
+uint64_t MapSubscriber::getPublished()
+{
+    return (header != NULL) ? header->published.load(std::memory_order_acquire) : 0;
+}
@@ -0,0 +1,111 @@
+#ifndef _PATHPLANNING_MAP_PUBLISHER_HPP_
+#define _PATHPLANNING_MAP_PUBLISHER_HPP_
+
+#include <base/samples/DistanceImage.hpp>
+#include <base/Waypoint.hpp>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace PathPlanning_lib
+{
+    // A POSIX shared memory segment holding a ring of slots. Publication k
+    // goes to slot k % slotCount, guarded by a seqlock: the slot sequence is
+    // 2k+1 while it is written and 2k+2 once it is complete. Readers take the
+    // latest publication, read it in place and check afterwards that its
+    // sequence did not move, so they never block the planner
+    enum map_content
+    {
+        MAP_IMAGE, //DistanceImage, one float per pixel
+        MAP_PATH   //Waypoints, x, y, z and heading per waypoint
+    };
+
+    struct mapSlotHeader
+    {
+        std::atomic<uint64_t> sequence;
+        uint32_t content; //map_content
+        uint32_t width; //Pixels, or waypoints for a path
+        uint32_t height; //Floats per waypoint, 4, for a path
+        float scale_x;
+        float scale_y;
+        float center_x;
+        float center_y;
+        int64_t time; //Microseconds
+    };
+
+    struct mapSegmentHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t slotCount;
+        uint64_t slotCapacity; //Floats of payload per slot
+        uint64_t slotStride; //Bytes from one slot to the next
+        std::atomic<uint64_t> published; //Completed publications
+    };
+
+    struct mapView
+    {
+        const mapSlotHeader* header; //Metadata of the publication, in place
+        const float* data; //Payload, in place
+        uint64_t sequence; //To be checked with MapSubscriber::isValid
+        mapView()
+        {
+            header = NULL;
+            data = NULL;
+            sequence = 0;
+        }
+    };
+
+    class MapPublisher
+    {
+        private:
+            std::string name;
+            int fd;
+            uint8_t* segment;
+            size_t segmentSize;
+            mapSegmentHeader* header;
+            mapSlotHeader* writing; //Slot between beginPublish and endPublish
+            uint64_t writingSequence;
+        public:
+            MapPublisher(std::string _name);
+            ~MapPublisher();
+
+            bool create(uint slotCount, uint64_t slotCapacity);
+            void close(bool unlink);
+
+            float* beginPublish(map_content content, uint width, uint height);
+            mapSlotHeader* getWritingHeader();
+            void endPublish();
+
+            bool publish(const base::samples::DistanceImage& image);
+            bool publish(const std::vector<base::Waypoint>& path, base::Time time);
+            uint64_t getPublished();
+    };
+
+    class MapSubscriber
+    {
+        private:
+            std::string name;
+            int fd;
+            uint8_t* segment;
+            size_t segmentSize;
+            const mapSegmentHeader* header;
+        public:
+            MapSubscriber(std::string _name);
+            ~MapSubscriber();
+
+            bool open();
+            void close();
+
+            bool view(mapView& latest);
+            bool isValid(const mapView& latest);
+
+            bool read(base::samples::DistanceImage& image, uint retries = 8);
+            bool read(std::vector<base::Waypoint>& path, uint retries = 8);
+            uint64_t getPublished();
+    };
+
+} // end namespace PathPlanning_lib
+
+#endif // _PATHPLANNING_MAP_PUBLISHER_HPP_
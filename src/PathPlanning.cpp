@@ -1,7 +1,19 @@
 #include "PathPlanning.hpp"
+#include "PlannerLog.hpp"
+#include "MapPublisher.hpp"
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <algorithm>
+#include <set>
+#include <queue>
+#include <functional>
+#include <utility>
+#include <atomic>
+#include <thread>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 using namespace PathPlanning_lib;
@@ -15,10 +27,37 @@ PathPlanning::PathPlanning(std::vector< terrainType* > _table,
 {
     global_goalNode = NULL;
     risk_distance = 0.5; //TODO: Make this configurable
-    std::cout << "PLANNER: Cost data is [ ";
+    deltaIngestion = false;
+    riskEngine = RISK_EIKONAL;
+    riskEpoch = 0;
+    riskUpdateEpoch = 0;
+    isRiskEpochObserved = false;
+    riskThreads = 1;
+    localRegionMargin = 10*risk_distance;
+    localNodeBudget = 1000000;
+    localTimeBudget = 1.0;
+    localStatus = LOCAL_REACHED;
+    safeMaskEpoch = 0;
+    localWarmStart = true;
+    localFieldSource = NULL;
+    localFieldEnd = NULL;
+    localFieldEpoch = 0;
+    pathIntegrator = INTEGRATOR_EULER;
+    integratorTolerance = 0.01;
+    integratorMaxScale = 8;
+    compactTolerance = 0;
+    locomotionHeadingBins = 16;
+    multiLayer = false;
+    modeSwitchCost = 0;
+    layerThreads = 1;
+    globalFieldEpoch = 0;
+    globalMapEpoch = 0;
+    localCostEpoch = 0;
+    clearLocalRegion();
+    std::ostringstream costs;
     for(uint i = 0; i<cost_data.size(); i++)
-        std::cout << cost_data[i] << " ";
-    std::cout << " ]" << std::endl;;
+        costs << cost_data[i] << " ";
+    PLANNER_DEBUG("Cost data is [ " << costs.str() << " ]");
 }
 
 PathPlanning::~PathPlanning()
@@ -31,17 +70,19 @@ void PathPlanning::initGlobalMap(double globalCellSize,  double localCellSize,
                                  std::vector< std::vector<double> > elevation,
                                  std::vector< std::vector<double> > cost)
 {
-    t1 = base::Time::now();
+    base::Time tInit = base::Time::now();
+    t1 = tInit;
     global_cellSize = globalCellSize;
     local_cellSize = localCellSize;
     ratio_scale = (uint)(global_cellSize/local_cellSize);
 
-    std::cout << "PLANNER: Creating Global Map using scale " <<
-                 global_cellSize << " m" << std::endl;
-    std::cout << "PLANNER: Each global edge is composed by " <<
-                 ratio_scale << " local nodes, having a local resolution of " <<
-                 local_cellSize << " m" << std::endl;
+    PLANNER_DEBUG("Creating Global Map using scale " <<
+                  global_cellSize << " m");
+    PLANNER_DEBUG("Each global edge is composed by " <<
+                  ratio_scale << " local nodes, having a local resolution of " <<
+                  local_cellSize << " m");
     global_offset = offset;
+    globalMapEpoch++;
     std::vector<globalNode*> nodeRow;
     uint i,j;
     for (j = 0; j < cost.size(); j++)
@@ -56,12 +97,12 @@ void PathPlanning::initGlobalMap(double globalCellSize,  double localCellSize,
         globalMap.push_back(nodeRow);
         nodeRow.clear();
     }
-    std::cout << "PLANNER: Global Map of "<< globalMap[0].size() << " x "
-              << globalMap.size() << " nodes created in "
-              << (base::Time::now()-t1) << " s" << std::endl;
+    PLANNER_INFO("Global Map of "<< globalMap[0].size() << " x "
+                 << globalMap.size() << " nodes created in "
+                 << (base::Time::now()-t1) << " s");
 
   // NEIGHBOURHOOD
-    printf("PLANNER: Building Global Map Neighbourhood\n");
+    PLANNER_DEBUG("Building Global Map Neighbourhood");
     t1 = base::Time::now();
     for (uint j = 0; j < globalMap.size(); j++)
     {
@@ -85,11 +126,11 @@ void PathPlanning::initGlobalMap(double globalCellSize,  double localCellSize,
             globalMap[j][i]->nb4List.push_back(getGlobalNode(i,j+1));
         }
     }
-    std::cout << "PLANNER: Neighbourhood made in " << (base::Time::now()-t1)
-              << " s" << std::endl;
+    PLANNER_DEBUG("Neighbourhood made in " << (base::Time::now()-t1)
+                  << " s");
 
   // SLOPE AND ASPECT
-    printf("PLANNER: Calculating Nominal Cost, Slope and Aspect values\n");
+    PLANNER_DEBUG("Calculating Nominal Cost, Slope and Aspect values");
     t1 = base::Time::now();
     for (j = 0; j < globalMap.size(); j++)
         for (i = 0; i < globalMap[0].size(); i++)
@@ -102,8 +143,16 @@ void PathPlanning::initGlobalMap(double globalCellSize,  double localCellSize,
         {
             calculateSmoothCost(globalMap[j][i]);
         }
-    std::cout << "PLANNER: Nominal Cost, Slope and Aspect calculated in " << (base::Time::now()-t1)
-              << " s" << std::endl;
+    PLANNER_DEBUG("Nominal Cost, Slope and Aspect calculated in " << (base::Time::now()-t1)
+                  << " s");
+
+  // LOCOMOTION MODES
+    t1 = base::Time::now();
+    buildLocomotionTable();
+    modeLayers.modes = 0; //Rebuilt from this map by the next layered propagation
+    PLANNER_DEBUG("Locomotion table with " << locomotionTable.headingBins
+                  << " heading bins built in " << (base::Time::now()-t1) << " s");
+    counters.initTime += (base::Time::now() - tInit).toSeconds();
 }
 
 globalNode* PathPlanning::getGlobalNode(uint i, uint j)
@@ -237,14 +286,14 @@ bool PathPlanning::setGoal(base::Waypoint wGoal)
         (candidateGoal->nb4List[2]->terrain == 0)||
         (candidateGoal->nb4List[3]->terrain == 0))
     {
-        std::cout << "PLANNING: Goal NOT valid, nearest global node is (" << global_goalNode->pose.position[0]
-                << "," << global_goalNode->pose.position[1] << ") and is forbidden area" << std::endl;
+        PLANNER_WARNING("Goal NOT valid, nearest global node is (" << global_goalNode->pose.position[0]
+                        << "," << global_goalNode->pose.position[1] << ") and is forbidden area");
         return false;
     }
     global_goalNode = candidateGoal;
     global_goalNode->pose.orientation = wGoal.heading;
-    std::cout << "PLANNING: Goal is global node (" << global_goalNode->pose.position[0]
-              << "," << global_goalNode->pose.position[1] << ")" << std::endl;
+    PLANNER_INFO("Goal is global node (" << global_goalNode->pose.position[0]
+                 << "," << global_goalNode->pose.position[1] << ")");
     return true;
 }
 
@@ -255,7 +304,7 @@ void PathPlanning::calculateGlobalPropagation(base::Waypoint wPos)
   // Global Nodes reset
     if (!global_propagatedNodes.empty())
     {
-        std::cout<< "PLANNER: resetting global nodes for new goal" << std::endl;
+        PLANNER_DEBUG("resetting global nodes for new goal");
         for(uint i = 0; i<global_propagatedNodes.size(); i++)
         {
             global_propagatedNodes[i]->state = OPEN;
@@ -270,24 +319,374 @@ void PathPlanning::calculateGlobalPropagation(base::Waypoint wPos)
     global_propagatedNodes.push_back(global_goalNode);
     global_goalNode->total_cost = 0;
     global_goalNode->nodeLocMode = terrainTable[global_goalNode->terrain]->optimalLM;
-    globalNode * nodeTarget;
+    globalNode * nodeTarget = global_goalNode;
 
     t1 = base::Time::now();
-    std::cout<< "PLANNER: starting global propagation loop " << std::endl;
-    while ((!global_narrowBand.empty())&&(nodeTarget->total_cost < INF))
+    globalFieldEpoch++;
+    counters.globalPropagations++;
+    modeLayers.isValid = false;
+    if (multiLayer && (locomotion_modes.size() > 1))
+        calculateLayeredPropagation();
+    else
     {
-        nodeTarget = minCostGlobalNode();
-        nodeTarget->state = CLOSED;
-        for (uint i = 0; i<4; i++)
-            if ((nodeTarget->nb4List[i] != NULL) &&
-                (nodeTarget->nb4List[i]->state == OPEN))
-                    propagateGlobalNode(nodeTarget->nb4List[i]);
+        PLANNER_DEBUG("starting global propagation loop ");
+        while ((!global_narrowBand.empty())&&(nodeTarget->total_cost < INF))
+        {
+            counters.globalPeakNarrowBand = std::max(counters.globalPeakNarrowBand,
+                                                     (uint64_t)global_narrowBand.size());
+            nodeTarget = minCostGlobalNode();
+            nodeTarget->state = CLOSED;
+            counters.globalNodesPopped++;
+            for (uint i = 0; i<4; i++)
+                if ((nodeTarget->nb4List[i] != NULL) &&
+                    (nodeTarget->nb4List[i]->state == OPEN))
+                        propagateGlobalNode(nodeTarget->nb4List[i]);
+        }
+        PLANNER_DEBUG("ended global propagation loop");
     }
-    std::cout<< "PLANNER: ended global propagation loop" << std::endl;
+    buildGradientField();
     t1 = base::Time::now() - t1;
-    std::cout<<"Computation Time: " << t1 << std::endl;
+    counters.globalPropagationTime += t1.toSeconds();
+    PLANNER_DEBUG("Computation Time: " << t1);
     expectedCost = getInterpolatedCost(wPos);
-    std::cout << "PLANNER: expected total cost: " << expectedCost << std::endl; // This is non interpolated, just to verify quickly, must be changed...
+    PLANNER_INFO("expected total cost: " << expectedCost); // This is non interpolated, just to verify quickly, must be changed...
+}
+
+void PathPlanning::setMultiLayerPropagation(bool enabled, double switchCost, uint threads)
+{
+    multiLayer = enabled;
+    modeSwitchCost = fmax(switchCost, 0.0);
+    layerThreads = std::max(threads,(uint)1);
+}
+
+void PathPlanning::buildModeLayers()
+{
+  // Same rules as calculateNominalCost and calculateSmoothCost, without
+  // taking the minimum over the locomotion modes
+    int range = slope_range.size();
+    int numLocs = locomotion_modes.size();
+    locomotionLayers& layers = modeLayers;
+    layers.width = globalMap[0].size();
+    layers.height = globalMap.size();
+    layers.modes = numLocs;
+    uint nodes = layers.width*layers.height;
+    layers.cost.resize(numLocs*nodes);
+    for (uint j = 0; j < layers.height; j++)
+        for (uint i = 0; i < layers.width; i++)
+        {
+            globalNode * gNode = globalMap[j][i];
+            double slopeIndex = (range == 1) ? 0 :
+                gNode->slope*180/M_PI/(slope_range.back()-slope_range.front())*(range-1);
+            double slopeMinIndex = std::floor(slopeIndex);
+            double slopeMaxIndex = std::ceil(slopeIndex);
+            for (int m = 0; m < numLocs; m++)
+            {
+                double C;
+                if ((gNode->terrain == 0)||(slopeIndex > range-1))
+                    C = cost_data[0];
+                else if (range == 1)
+                    C = cost_data[gNode->terrain*numLocs + m];
+                else
+                {
+                    double C1 = cost_data[gNode->terrain*range*numLocs + m*range + (int)slopeMinIndex];
+                    double C2 = cost_data[gNode->terrain*range*numLocs + m*range + (int)slopeMaxIndex];
+                    C = C1 + (C2-C1)*(slopeIndex-slopeMinIndex);
+                }
+                layers.cost[m*nodes + j*layers.width + i] = C;
+            }
+        }
+
+  // Smoothed in place in the order of initGlobalMap, the neighbours at j-1
+  // and i-1 are already smoothed when a node is. Where one mode is the
+  // cheapest on every node its layer holds the same costs as the global
+  // map, otherwise the global map smooths the minimum over the modes and
+  // no layer matches it
+    for (int m = 0; m < numLocs; m++)
+        for (uint j = 0; j < layers.height; j++)
+            for (uint i = 0; i < layers.width; i++)
+            {
+                double* c = &layers.cost[m*nodes];
+                uint index = j*layers.width + i;
+                double Csum = c[index], n = 5;
+                if (j > 0) Csum += c[index - layers.width]; else n--;
+                if (i > 0) Csum += c[index - 1]; else n--;
+                if (i + 1 < layers.width) Csum += c[index + 1]; else n--;
+                if (j + 1 < layers.height) Csum += c[index + layers.width]; else n--;
+                c[index] = std::max(c[index], Csum/n);
+            }
+}
+
+double PathPlanning::layerEikonal(uint mode, uint index)
+{
+  // propagateGlobalNode on the layer of one locomotion mode
+    locomotionLayers& layers = modeLayers;
+    uint nodes = layers.width*layers.height;
+    uint i = index % layers.width;
+    uint j = index / layers.width;
+    const double* T = &layers.total_cost[mode*nodes];
+    globalNode * gNode = globalMap[j][i];
+
+    double Ty = fmin((j > 0) ? T[index - layers.width] : INF,
+                     (j + 1 < layers.height) ? T[index + layers.width] : INF);
+    double Tx = fmin((i > 0) ? T[index - 1] : INF,
+                     (i + 1 < layers.width) ? T[index + 1] : INF);
+
+    double C, k = gNode->obstacle_ratio;
+    if(k>0.99)
+        C = global_cellSize*cost_data[0];
+    else
+        C = std::min((global_cellSize*layers.cost[mode*nodes + index])/(cos(gNode->slope))/(1-k),
+                     global_cellSize*cost_data[0]);
+
+    if ((fabs(Tx-Ty)<C)&&(Tx < INF)&&(Ty < INF))
+        return (Tx+Ty+sqrt(2*pow(C,2.0) - pow((Tx-Ty),2.0)))/2;
+    return fmin(Tx,Ty) + C;
+}
+
+bool PathPlanning::marchModeLayer(uint mode, std::vector<uint>& seeds,
+                                  plannerCounters& layerCounters)
+{
+  // Fast marching from the seeds, whose cost is already set. A node is
+  // revisited whenever its cost drops, so later rounds may seed nodes
+  // behind the front. Returns whether any cost changed
+    locomotionLayers& layers = modeLayers;
+    uint nodes = layers.width*layers.height;
+    double* T = &layers.total_cost[mode*nodes];
+    typedef std::pair<double,uint> bandEntry;
+    std::priority_queue< bandEntry, std::vector<bandEntry>, std::greater<bandEntry> > band;
+    for (uint s = 0; s < seeds.size(); s++)
+        band.push(bandEntry(T[seeds[s]], seeds[s]));
+    bool changed = !seeds.empty();
+    seeds.clear();
+
+    uint nb[4];
+    while (!band.empty())
+    {
+        layerCounters.globalPeakNarrowBand = std::max(layerCounters.globalPeakNarrowBand,
+                                                      (uint64_t)band.size());
+        bandEntry entry = band.top();
+        band.pop();
+        uint index = entry.second;
+        if (entry.first > T[index])
+            continue;
+        layerCounters.globalNodesPopped++;
+        uint i = index % layers.width;
+        uint j = index / layers.width;
+        uint count = 0;
+        if (j > 0) nb[count++] = index - layers.width;
+        if (i > 0) nb[count++] = index - 1;
+        if (i + 1 < layers.width) nb[count++] = index + 1;
+        if (j + 1 < layers.height) nb[count++] = index + layers.width;
+        for (uint n = 0; n < count; n++)
+        {
+            double Tnb = layerEikonal(mode, nb[n]);
+            if (Tnb < T[nb[n]])
+            {
+                T[nb[n]] = Tnb;
+                band.push(bandEntry(Tnb, nb[n]));
+                layerCounters.globalNodesUpdated++;
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+void PathPlanning::calculateLayeredPropagation()
+{
+  // Every locomotion mode has its own cost layer. The layers are marched
+  // in parallel from the goal, then each node of a layer is seeded with
+  // the cheapest other layer plus modeSwitchCost wherever that is lower,
+  // and the marching is repeated until no layer improves
+    if ((modeLayers.modes != locomotion_modes.size())||
+        (modeLayers.width != globalMap[0].size())||(modeLayers.height != globalMap.size()))
+        buildModeLayers();
+    locomotionLayers& layers = modeLayers;
+    uint nodes = layers.width*layers.height;
+    uint goalIndex = (uint)global_goalNode->pose.position[1]*layers.width +
+                     (uint)global_goalNode->pose.position[0];
+    layers.total_cost.assign(layers.modes*nodes, INF);
+    std::vector< std::vector<uint> > seeds(layers.modes);
+    for (uint m = 0; m < layers.modes; m++)
+    {
+        layers.total_cost[m*nodes + goalIndex] = 0;
+        seeds[m].push_back(goalIndex);
+    }
+
+    PLANNER_DEBUG("starting layered propagation of " << layers.modes << " locomotion modes");
+    uint threads = std::min(layerThreads, layers.modes);
+    std::vector<plannerCounters> layerCounters(layers.modes); //One per layer, workers do not share them
+    uint rounds = 0;
+    bool changed = true;
+    while (changed)
+    {
+        rounds++;
+        std::vector<char> layerChanged(layers.modes, 0);
+        if (threads <= 1)
+        {
+            for (uint m = 0; m < layers.modes; m++)
+                layerChanged[m] = marchModeLayer(m, seeds[m], layerCounters[m]);
+        }
+        else
+        {
+          // Layers are independent within a round, each worker takes the next one
+            std::atomic<uint> nextLayer(0);
+            std::vector<std::thread> workers;
+            for (uint t = 0; t < threads; t++)
+                workers.push_back(std::thread([&]()
+                {
+                    uint m;
+                    while ((m = nextLayer++) < layers.modes)
+                        layerChanged[m] = marchModeLayer(m, seeds[m], layerCounters[m]);
+                }));
+            for (uint t = 0; t < threads; t++)
+                workers[t].join();
+        }
+
+        changed = false;
+        for (uint index = 0; index < nodes; index++)
+        {
+            double best = INF;
+            for (uint m = 0; m < layers.modes; m++)
+                best = fmin(best, layers.total_cost[m*nodes + index]);
+            if (!(best < INF))
+                continue;
+            for (uint m = 0; m < layers.modes; m++)
+                if (best + modeSwitchCost < layers.total_cost[m*nodes + index])
+                {
+                    layers.total_cost[m*nodes + index] = best + modeSwitchCost;
+                    seeds[m].push_back(index);
+                    changed = true;
+                }
+        }
+    }
+    PLANNER_DEBUG("ended layered propagation after " << rounds << " rounds");
+    for (uint m = 0; m < layers.modes; m++)
+    {
+        counters.globalNodesPopped += layerCounters[m].globalNodesPopped;
+        counters.globalNodesUpdated += layerCounters[m].globalNodesUpdated;
+        counters.globalPeakNarrowBand = std::max(counters.globalPeakNarrowBand,
+                                                 layerCounters[m].globalPeakNarrowBand);
+    }
+
+  // The global field is the cheapest layer, labelled with its mode
+    global_narrowBand.clear();
+    global_propagatedNodes.clear();
+    for (uint j = 0; j < layers.height; j++)
+        for (uint i = 0; i < layers.width; i++)
+        {
+            uint index = j*layers.width + i;
+            uint bestMode = bestLayerMode(index);
+            if (!(layers.total_cost[bestMode*nodes + index] < INF))
+                continue;
+            globalNode * gNode = globalMap[j][i];
+            gNode->total_cost = layers.total_cost[bestMode*nodes + index];
+            gNode->nodeLocMode = locomotion_modes[bestMode];
+            gNode->state = CLOSED;
+            global_propagatedNodes.push_back(gNode);
+        }
+    layers.isValid = true;
+}
+
+uint PathPlanning::bestLayerMode(uint index)
+{
+  // Cheapest layer at the node. Where switching is free several layers have
+  // the same cost, the mode that is cheaper on the node itself is taken
+    const locomotionLayers& layers = modeLayers;
+    uint nodes = layers.width*layers.height;
+    uint bestMode = 0;
+    for (uint m = 1; m < layers.modes; m++)
+    {
+        double T = layers.total_cost[m*nodes + index];
+        double Tbest = layers.total_cost[bestMode*nodes + index];
+        if ((T < Tbest - 1e-9*(1 + Tbest))||
+            ((T <= Tbest + 1e-9*(1 + Tbest))&&
+             (layers.cost[m*nodes + index] < layers.cost[bestMode*nodes + index])))
+            bestMode = m;
+    }
+    return bestMode;
+}
+
+void PathPlanning::getPathLocomotionModes(const std::vector<base::Waypoint>& path,
+                                          std::vector<uint>& modes)
+{
+  // With the layered field the mode only changes where switching is not
+  // more expensive than staying, otherwise the heading binned table is used
+    if (!modeLayers.isValid)
+    {
+        std::vector<double> costs;
+        getLocomotionModes(path, modes, costs);
+        return;
+    }
+    const locomotionLayers& layers = modeLayers;
+    uint nodes = layers.width*layers.height;
+    modes.resize(path.size());
+    uint mode = layers.modes;
+    for (uint k = 0; k < path.size(); k++)
+    {
+        int i = (int)(path[k].position[0]/global_cellSize + 0.5);
+        int j = (int)(path[k].position[1]/global_cellSize + 0.5);
+        if ((i < 0)||(j < 0)||(i >= (int)layers.width)||(j >= (int)layers.height))
+        {
+            modes[k] = (mode < layers.modes) ? mode : 0;
+            continue;
+        }
+        uint index = j*layers.width + i;
+        uint bestMode = bestLayerMode(index);
+      // A layer costing exactly the switch more got its value from switching here
+        double Tswitch = layers.total_cost[bestMode*nodes + index] + modeSwitchCost;
+        if ((mode >= layers.modes)||
+            (layers.total_cost[mode*nodes + index] >= Tswitch - 1e-9*(1 + Tswitch)))
+            mode = bestMode;
+        modes[k] = mode;
+    }
+}
+
+void PathPlanning::buildGradientField()
+{
+  // total_cost is copied into a grid padded with INF, so that every node has
+  // its four neighbours and the gradient rows below run without branches on
+  // NULL neighbours. The rules are the same as gradientNode
+    uint width = globalMap[0].size();
+    uint height = globalMap.size();
+    uint paddedWidth = width + 2;
+    std::vector<double> costs(paddedWidth*(height + 2), INF);
+    globalGradient.width = width;
+    globalGradient.height = height;
+    globalGradient.dx.resize(width*height);
+    globalGradient.dy.resize(width*height);
+    globalGradient.elevation.resize(width*height);
+    for (uint j = 0; j < height; j++)
+        for (uint i = 0; i < width; i++)
+        {
+            costs[(j+1)*paddedWidth + i + 1] = globalMap[j][i]->total_cost;
+            globalGradient.elevation[j*width + i] = globalMap[j][i]->elevation;
+        }
+
+    for (uint j = 0; j < height; j++)
+    {
+        const double* rowDown = &costs[j*paddedWidth];
+        const double* row = &costs[(j+1)*paddedWidth];
+        const double* rowUp = &costs[(j+2)*paddedWidth];
+        double* dnx = &globalGradient.dx[j*width];
+        double* dny = &globalGradient.dy[j*width];
+        for (uint i = 0; i < width; i++)
+        {
+            double c = row[i+1];
+            double left = row[i];
+            double right = row[i+2];
+            double down = rowDown[i+1];
+            double up = rowUp[i+1];
+            double dx = (left == INF) ? ((right == INF) ? 0 : right - c)
+                                      : ((right == INF) ? c - left : (right - left)*0.5);
+            double dy = (down == INF) ? ((up == INF) ? 0 : up - c)
+                                      : ((up == INF) ? c - down : (up - down)*0.5);
+            double norm = sqrt(dx*dx + dy*dy);
+            dnx[i] = (norm > 0) ? dx/norm : 0;
+            dny[i] = (norm > 0) ? dy/norm : 0;
+        }
+    }
+    globalGradient.isValid = true;
 }
 
 void PathPlanning::propagateGlobalNode(globalNode* nodeTarget)
@@ -354,6 +753,7 @@ void PathPlanning::propagateGlobalNode(globalNode* nodeTarget)
         }
         nodeTarget->total_cost = T;
         nodeTarget->nodeLocMode = terrainTable[nodeTarget->terrain]->optimalLM;
+        counters.globalNodesUpdated++;
     }
 }
 
@@ -380,38 +780,16 @@ globalNode* PathPlanning::minCostGlobalNode()
 
 base::samples::DistanceImage PathPlanning::getGlobalTotalCostMap()
 {
-    base::samples::DistanceImage globalTotalCostMap;
-    globalTotalCostMap.setSize(globalMap[0].size(),globalMap.size());
-    for (uint j = 0; j < globalMap.size(); j++)
-    {
-        for (uint i = 0; i < globalMap[0].size(); i++)
-        {
-                globalTotalCostMap.data[i + j*globalMap[0].size()] = (globalMap[j][i]->total_cost);
-        }
-    }
-    globalTotalCostMap.scale_x = global_cellSize;
-    globalTotalCostMap.scale_y = global_cellSize;
-    globalTotalCostMap.center_x = global_offset.position[0] + global_cellSize*0.5*globalMap[0].size();
-    globalTotalCostMap.center_y = global_offset.position[1] + global_cellSize*0.5*globalMap.size();
-    return globalTotalCostMap;
+    mapExport out;
+    exportGlobalTotalCostMap(out);
+    return out.image;
 }
 
 base::samples::DistanceImage PathPlanning::getGlobalCostMap()
 {
-    base::samples::DistanceImage globalCostMap;
-    globalCostMap.setSize(globalMap[0].size(),globalMap.size());
-    for (uint j = 0; j < globalMap.size(); j++)
-    {
-        for (uint i = 0; i < globalMap[0].size(); i++)
-        {
-                globalCostMap.data[i + j*globalMap[0].size()] = (globalMap[j][i]->cost);
-        }
-    }
-    globalCostMap.scale_x = global_cellSize;
-    globalCostMap.scale_y = global_cellSize;
-    globalCostMap.center_x = global_offset.position[0] + global_cellSize*0.5*globalMap[0].size();
-    globalCostMap.center_y = global_offset.position[1] + global_cellSize*0.5*globalMap.size();
-    return globalCostMap;
+    mapExport out;
+    exportGlobalCostMap(out);
+    return out.image;
 }
 
 
@@ -558,6 +936,7 @@ void PathPlanning::expandGlobalNode(globalNode* gNode)
     {
       gNode->hasLocalMap = true;
       createLocalMap(gNode);
+      counters.localTilesCreated++;
     }
 }
 
@@ -608,7 +987,7 @@ void PathPlanning::updateLocalMap(base::Waypoint wPos)
     if (actualGlobalNodePos != nearestNode)
     {
         actualGlobalNodePos = nearestNode;
-        std::cout << "PLANNER: Building new local maps" << std::endl;
+        PLANNER_DEBUG("Building new local maps");
         uint a = (uint)(fmax(0,((wPos.position[1] - 6.0)/global_cellSize)));
         uint b = (uint)(fmin(globalMap.size(),((wPos.position[1] + 6.0)/global_cellSize)));
         uint c = (uint)(fmax(0,((wPos.position[0] - 6.0)/global_cellSize)));
@@ -620,53 +999,26 @@ void PathPlanning::updateLocalMap(base::Waypoint wPos)
 }
 
 bool PathPlanning::evaluateLocalMap(base::Waypoint wPos,
-                                    base::samples::frame::Frame traversabilityMap,
+                                    const base::samples::frame::Frame& traversabilityMap,
                                     double res,
                                     std::vector<base::Waypoint>& trajectory)
 {
     t1 = base::Time::now();
-    std::vector<localNode*> localNodesToUpdate;
-    localNode* lNode;
-    globalNode* gNode;
 
     localExpandableObstacles.clear(); //obstacles whose risk has to be expanded
 
-  //Indexes of the minimum and maximum waypoints affected in the trajectory by obstacles
-    uint minIndex = globalPath.size(), maxIndex = 0, candidateIndex;
-    bool isBlocked = false;
+    uint newObstacles = ingestTraversabilityMap(wPos, traversabilityMap);
+    PLANNER_INFO(newObstacles << " new obstacle nodes ingested in "
+                 << (base::Time::now()-t1) << " s");
 
-    double offsetX = wPos.position[0] - traversabilityMap.getWidth()/2;
-    double offsetY = wPos.position[1] - traversabilityMap.getHeight()/2;
+  //Indexes of the minimum and maximum waypoints affected in the trajectory by obstacles
+    uint minIndex = globalPath.size(), maxIndex = 0;
+    for (uint i = 0; i < localExpandableObstacles.size(); i++)
+        isBlockingObstacle(localExpandableObstacles[i], maxIndex, minIndex);//See here if its blocking (and which waypoint)
 
-    for (uint j = 0; j < traversabilityMap.getHeight(); j++)
-    {
-        for (uint i = 0; i < traversabilityMap.getWidth(); i++)
-        {
-            //if (initializing)
-            base::Pose2D pos;
-            pos.position[0] = offsetX + i*local_cellSize;
-            pos.position[1] = offsetY + j*local_cellSize;
-            uint value = traversabilityMap.image[j*traversabilityMap.getRowSize()+i*traversabilityMap.getPixelSize()]; //TODO: check if this is correct!!
-            if (value == 0) //If pixel is obstacle
-            {
-                    lNode = getLocalNode(pos);
-                    if (!lNode->isObstacle)
-                    {
-                        lNode->isObstacle = true;
-                        localExpandableObstacles.push_back(lNode);
-                        lNode->risk = 1.0;
-                        gNode = getNearestGlobalNode(lNode->parent_pose);
-                        gNode->obstacle_ratio += pow((1/(double)ratio_scale),2);
-                        for(uint i = 0; i<4; i++)
-                            gNode->nb4List[i]->obstacle_ratio += 0.2*pow((1/(double)ratio_scale),2);
-                        isBlocked = isBlockingObstacle(lNode, maxIndex, minIndex);//See here if its blocking (and which waypoint)
-                    }
-            }
-        }
-    }
     //In case an obstacle is blocking, expand the Risk and start repairing
-    std::cout << "PLANNER: index = " << minIndex << std::endl;
-    std::cout << "PLANNER: globalPath size = " << globalPath.size() << std::endl;
+    PLANNER_DEBUG("index = " << minIndex);
+    PLANNER_DEBUG("globalPath size = " << globalPath.size());
 
 
     if(minIndex < globalPath.size())
@@ -678,149 +1030,680 @@ bool PathPlanning::evaluateLocalMap(base::Waypoint wPos,
     return false;
 }
 
-void PathPlanning::repairPath(std::vector<base::Waypoint>& trajectory, uint minIndex, uint maxIndex)
+// Returns in columns the indexes of the pixels of the row whose value is 0
+// (obstacle). Grayscale rows are scanned 16 pixels at a time.
+static void findObstaclePixels(const uint8_t* row, uint width, uint pixelSize,
+                               std::vector<uint>& columns)
 {
-    std::cout << "PLANNER: trajectory from waypoint " << minIndex << " to waypoint " << maxIndex << " must be repaired" << std::endl;
-    std::cout << "PLANNER: size of globalPath is " << globalPath.size() << std::endl;
-    uint indexLim = 0;
-    for(uint i = minIndex; i>0;i--)
-    {
-        if (sqrt(
-              pow(globalPath[i].position[0]-globalPath[minIndex].position[0],2)
-            + pow(globalPath[i].position[1]-globalPath[minIndex].position[1],2)
-          ) > 2*risk_distance)
-        {
-            indexLim = i;
-            break;
-        }
-    }
-
-    if(maxIndex >= globalPath.size()-1) //This means last waypoint is on forbidden area
+    uint i = 0;
+#ifdef __SSE2__
+    if (pixelSize == 1)
     {
-        /*trajectory.resize(minIndex);
-        isGlobalWaypoint.resize(minIndex);
-        std::cout << "PLANNER: trajectory is shortened due to goal placed on forbidden area" << std::endl;
-        return true;*/
-        globalPath.resize(indexLim+1);
-        for(uint i = 0; i<trajectory.size(); i++)
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= width; i += 16)
         {
-            if ((trajectory[i].position[0] == globalPath.back().position[0])&&
-                (trajectory[i].position[1] == globalPath.back().position[1])&&
-                (trajectory[i].heading == globalPath.back().heading))
+            __m128i pixels = _mm_loadu_si128((const __m128i*)(row + i));
+            uint mask = (uint)_mm_movemask_epi8(_mm_cmpeq_epi8(pixels, zero));
+            while (mask != 0)
             {
-                trajectory.resize(i+1);
-                break;
+                columns.push_back(i + __builtin_ctz(mask));
+                mask &= mask - 1;
             }
         }
-        std::cout << "PLANNER: trajectory is shortened due to goal placed on forbidden area" << std::endl;
     }
-    else
+#endif
+    for (; i < width; i++)
+        if (row[i*pixelSize] == 0)
+            columns.push_back(i);
+}
+
+// Returns in columns the indexes (from 0 to width) of the pixels whose
+// obstacle classification differs between current and previous mask rows
+static void findChangedPixels(const uint8_t* current, const uint8_t* previous,
+                              uint width, std::vector<uint>& columns)
+{
+    uint i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= width; i += 16)
     {
-        double Treach = getInterpolatedCost(globalPath[maxIndex]);
-        //Resize trajectory to eliminate non safe part of the trajectory
-        globalPath.resize(indexLim+1);
-        //Resize as well the globalPath pointers
-        for(uint i = 0; i<trajectory.size(); i++)
+        __m128i a = _mm_loadu_si128((const __m128i*)(current + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(previous + i));
+        uint mask = ~(uint)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0xFFFF;
+        while (mask != 0)
         {
-            if ((trajectory[i].position[0] == globalPath.back().position[0])&&
-                (trajectory[i].position[1] == globalPath.back().position[1])&&
-                (trajectory[i].heading == globalPath.back().heading))
-            {
-                trajectory.resize(i+1);
-                break;
-            }
+            columns.push_back(i + __builtin_ctz(mask));
+            mask &= mask - 1;
         }
-        std::cout << "PLANNER: global Path is repaired from " << indexLim << std::endl;
-        std::cout << "PLANNER: global Path size is " << globalPath.size() << std::endl;
-        std::cout << "PLANNER: trajectory is repaired from " << trajectory.size() << std::endl;
-      //Trajectory is repaired from indexLim
-        localNode * lSet = calculateLocalPropagation(trajectory.back(),Treach);
-        std::vector<base::Waypoint> localPath = getLocalPath(lSet,trajectory[indexLim],0.4);
-        base::Waypoint newWaypoint;
-        newWaypoint.position[0] = lSet->global_pose.position[0];
-        newWaypoint.position[1] = lSet->global_pose.position[1];
-        std::vector<base::Waypoint> restPath = getGlobalPath(newWaypoint);
-        trajectory.insert(trajectory.end(),localPath.begin(),localPath.end());
-        trajectory.insert(trajectory.end(),restPath.begin(),restPath.end());
     }
+#endif
+    for (; i < width; i++)
+        if (current[i] != previous[i])
+            columns.push_back(i);
 }
 
-bool PathPlanning::evaluateLocalMap(base::Waypoint wPos,
-                                       std::vector< std::vector<double> >& costMatrix,
-                                       double res,
-                                       std::vector<base::Waypoint>& trajectory)
+void PathPlanning::setDeltaIngestion(bool enabled)
 {
-    t1 = base::Time::now();
-    uint a = (uint)(fmax(0,((wPos.position[1] - 4.0)/res)));
-    uint b = (uint)(fmin(costMatrix.size(),((wPos.position[1] + 4.0)/res)));
-    uint c = (uint)(fmax(0,((wPos.position[0] - 4.0)/res)));
-    uint d = (uint)(fmin(costMatrix[0].size(),((wPos.position[0] + 4.0)/res)));
-    std::vector<localNode*> localNodesToUpdate;
-    localNode* lNode;
-    globalNode* gNode;
+    deltaIngestion = enabled;
+    previousFrame.isValid = false;
+    previousFrame.obstacleMask.clear();
+}
 
-    localExpandableObstacles.clear(); //obstacles whose risk has to be expanded
+uint PathPlanning::ingestTraversabilityMap(base::Waypoint wPos,
+                                           const base::samples::frame::Frame& traversabilityMap)
+{
+    base::Time tIngestion = base::Time::now();
+    beginRiskUpdate();
+
+    uint width = traversabilityMap.getWidth();
+    uint height = traversabilityMap.getHeight();
+    uint rowSize = traversabilityMap.getRowSize();
+    uint pixelSize = traversabilityMap.getPixelSize();
+    const uint8_t* image = traversabilityMap.getImageConstPtr();
+
+    double offsetX = wPos.position[0] - width/2;
+    double offsetY = wPos.position[1] - height/2;
+
+  // Global node and local index of every column and row of the frame,
+  // computed once instead of once per pixel. Pixels outside the global map
+  // are marked with globalMap size
+    uint globalWidth = globalMap[0].size();
+    uint globalHeight = globalMap.size();
+    std::vector<uint> columnGlobal(width), columnLocal(width);
+    std::vector<uint> rowGlobal(height), rowLocal(height);
+    for (uint i = 0; i < width; i++)
+    {
+        double x = (offsetX + i*local_cellSize)/global_cellSize;
+        columnGlobal[i] = (x < -0.5)?globalWidth:(uint)(x + 0.5);
+        columnLocal[i] = std::min((uint)((x - columnGlobal[i] + 0.5)*ratio_scale), ratio_scale-1);
+    }
+    for (uint j = 0; j < height; j++)
+    {
+        double y = (offsetY + j*local_cellSize)/global_cellSize;
+        rowGlobal[j] = (y < -0.5)?globalHeight:(uint)(y + 0.5);
+        rowLocal[j] = std::min((uint)((y - rowGlobal[j] + 0.5)*ratio_scale), ratio_scale-1);
+    }
 
-  //Indexes of the minimum and maximum waypoints affected in the trajectory by obstacles
-    uint minIndex = globalPath.size(), maxIndex = 0;
-    bool isBlocked = false;
+  // In delta mode the frame is registered with the previous one through the
+  // rover pose. Only an integer pixel shift can be registered, otherwise
+  // every pixel is processed as newly in view
+    int shiftX = 0, shiftY = 0;
+    bool registered = false;
+    std::vector<uint8_t> currentMask;
+    if (deltaIngestion)
+    {
+        currentMask.assign(width*height, 0);
+        double dx = (offsetX - previousFrame.offsetX)/local_cellSize;
+        double dy = (offsetY - previousFrame.offsetY)/local_cellSize;
+        shiftX = (int)floor(dx + 0.5);
+        shiftY = (int)floor(dy + 0.5);
+        registered = previousFrame.isValid &&
+                     (previousFrame.width == width)&&(previousFrame.height == height)&&
+                     (fabs(dx - shiftX) < 1e-3)&&(fabs(dy - shiftY) < 1e-3);
+    }
 
-    for (uint j = a; j < b; j++)
+  // Obstacle pixels are keyed by destination global node (high bits) and
+  // local node inside it (low bits), so sorting groups them per local tile
+    std::vector<uint> columns, changed;
+    std::vector<uint64_t> obstacleKeys, clearedKeys;
+    for (uint j = 0; j < height; j++)
     {
-        for (uint i = c; i < d; i++)
+        columns.clear();
+        findObstaclePixels(image + j*rowSize, width, pixelSize, columns);
+        if (!deltaIngestion)
         {
-            double dx = i*res - wPos.position[0];
-            double dy = j*res - wPos.position[1];
-            //if (initializing)
-            if (sqrt(pow(dx,2) + pow(dy,2)) < 3.0)
+            changed.swap(columns);
+        }
+        else
+        {
+            uint8_t* current = &currentMask[j*width];
+            for (uint n = 0; n < columns.size(); n++)
+                current[columns[n]] = 1;
+
+          // Overlap with the previous frame is [i0,i1), the rest of the row
+          // is newly in view
+            int pj = (int)j + shiftY;
+            int i0 = std::max(0, -shiftX), i1 = std::min((int)width, (int)width - shiftX);
+            if ((!registered)||(pj < 0)||(pj >= (int)height)||(i0 >= i1))
             {
-                base::Pose2D pos;
-                pos.position[0] = i*res;
-                pos.position[1] = j*res;
-                if (costMatrix[j][i] == 0) //If pixel is obstacle
-                {
-                    lNode = getLocalNode(pos);
-                    if (!lNode->isObstacle)
-                    {
-                        lNode->isObstacle = true;
-                        localExpandableObstacles.push_back(lNode);
-                        lNode->risk = 1.0;
-                        gNode = getNearestGlobalNode(lNode->parent_pose);
-                        gNode->obstacle_ratio += pow((1/ratio_scale),2);
-                        isBlocked = isBlockingObstacle(lNode, maxIndex, minIndex);//See here if its blocking (and which waypoint)
-                    }
-                }
+                i0 = 0;
+                i1 = 0;
+            }
+            changed.clear();
+            for (uint n = 0; n < columns.size(); n++)
+                if (((int)columns[n] < i0)||((int)columns[n] >= i1))
+                    changed.push_back(columns[n]);
+            if (i0 < i1)
+            {
+                const uint8_t* previous = &previousFrame.obstacleMask[pj*width + i0 + shiftX];
+                uint first = changed.size();
+                findChangedPixels(current + i0, previous, i1 - i0, changed);
+                for (uint n = first; n < changed.size(); n++)
+                    changed[n] += i0;
             }
         }
+        if (rowGlobal[j] >= globalHeight)
+            continue;
+        for (uint n = 0; n < changed.size(); n++)
+        {
+            uint i = changed[n];
+            if (columnGlobal[i] >= globalWidth)
+                continue;
+            uint64_t key = ((uint64_t)(rowGlobal[j]*globalWidth + columnGlobal[i]) << 32) |
+                           (rowLocal[j]*ratio_scale + columnLocal[i]);
+            if ((!deltaIngestion)||(currentMask[j*width + i]))
+                obstacleKeys.push_back(key);
+            else
+                clearedKeys.push_back(key);
+        }
     }
-    //In case an obstacle is blocking, expand the Risk and start repairing
-    std::cout << "PLANNER: index = " << minIndex << std::endl;
-    std::cout << "PLANNER: globalPath size = " << globalPath.size() << std::endl;
-
-    uint indexLim = 0;
-    if(minIndex < globalPath.size())
+    if (deltaIngestion)
     {
-        expandRisk();
-        repairPath(trajectory, minIndex, maxIndex);
-        return true;
+        previousFrame.obstacleMask.swap(currentMask);
+        previousFrame.offsetX = offsetX;
+        previousFrame.offsetY = offsetY;
+        previousFrame.width = width;
+        previousFrame.height = height;
+        previousFrame.isValid = true;
     }
-    /*if(minIndex < globalPath.size())
-    {
-        std::cout << "PLANNER: trajectory from waypoint " << minIndex << " to waypoint " << maxIndex << " must be repaired" << std::endl;
-        expandRisk();
+    std::sort(obstacleKeys.begin(), obstacleKeys.end());
+    std::sort(clearedKeys.begin(), clearedKeys.end());
 
-        for(uint i = minIndex; i>0;i--)
+    double localArea = pow((1/(double)ratio_scale),2);
+    uint totalObstacles = 0;
+    uint k = 0;
+    while (k < obstacleKeys.size())
+    {
+        uint tileIndex = (uint)(obstacleKeys[k] >> 32);
+        globalNode* gNode = globalMap[tileIndex/globalWidth][tileIndex%globalWidth];
+        expandGlobalNode(gNode);
+        uint newObstacles = 0;
+        for (; (k < obstacleKeys.size())&&((uint)(obstacleKeys[k] >> 32) == tileIndex); k++)
         {
-            if (sqrt(
-                  pow(globalPath[i].position[0]-globalPath[minIndex].position[0],2)
-                + pow(globalPath[i].position[1]-globalPath[minIndex].position[1],2)
-              ) > 2*risk_distance)
+            uint localIndex = (uint)(obstacleKeys[k] & 0xFFFFFFFF);
+            localNode* lNode = gNode->localMap[localIndex/ratio_scale][localIndex%ratio_scale];
+            if (!lNode->isObstacle)
             {
-                indexLim = i;
-                break;
+                lNode->isObstacle = true;
+                lNode->risk = 1.0;
+                localExpandableObstacles.push_back(lNode);
+                newObstacles++;
             }
         }
-
+        if (newObstacles > 0)
+        {
+            markRiskDirty(gNode);
+            gNode->obstacle_ratio += newObstacles*localArea;
+            for(uint i = 0; i<4; i++)
+                if (gNode->nb4List[i] != NULL)
+                    gNode->nb4List[i]->obstacle_ratio += 0.2*newObstacles*localArea;
+            totalObstacles += newObstacles;
+        }
+    }
+
+  // Obstacles seen in the previous frame that are now traversable
+    std::vector<localNode*> clearedNodes;
+    k = 0;
+    while (k < clearedKeys.size())
+    {
+        uint tileIndex = (uint)(clearedKeys[k] >> 32);
+        globalNode* gNode = globalMap[tileIndex/globalWidth][tileIndex%globalWidth];
+        uint cleared = 0;
+        for (; (k < clearedKeys.size())&&((uint)(clearedKeys[k] >> 32) == tileIndex); k++)
+        {
+            if (!gNode->hasLocalMap)
+                continue;
+            uint localIndex = (uint)(clearedKeys[k] & 0xFFFFFFFF);
+            localNode* lNode = gNode->localMap[localIndex/ratio_scale][localIndex%ratio_scale];
+            if (lNode->isObstacle)
+            {
+                lNode->isObstacle = false;
+                lNode->risk = 0;
+                clearedNodes.push_back(lNode);
+                cleared++;
+            }
+        }
+        if (cleared > 0)
+        {
+            markRiskDirty(gNode);
+            gNode->obstacle_ratio = fmax(0, gNode->obstacle_ratio - cleared*localArea);
+            for(uint i = 0; i<4; i++)
+                if (gNode->nb4List[i] != NULL)
+                    gNode->nb4List[i]->obstacle_ratio =
+                        fmax(0, gNode->nb4List[i]->obstacle_ratio - 0.2*cleared*localArea);
+        }
+    }
+    if (!clearedNodes.empty())
+    {
+        PLANNER_DEBUG(clearedNodes.size() << " obstacle nodes cleared");
+        retractRisk(clearedNodes);
+    }
+    counters.obstaclesIngested += totalObstacles;
+    counters.ingestionTime += (base::Time::now() - tIngestion).toSeconds();
+    return totalObstacles;
+}
+
+void PathPlanning::retractRisk(const std::vector<localNode*>& clearedNodes)
+{
+  // Nodes that may hold risk coming from the cleared obstacles, found walking
+  // the 4-neighbourhood through risky nodes. Risk reaches risk_distance in
+  // euclidean distance, which takes up to sqrt(2) times as many steps
+    uint steps = (uint)ceil(sqrt(2.0)*risk_distance/local_cellSize) + 1;
+    std::set<localNode*> inRegion(clearedNodes.begin(), clearedNodes.end());
+    std::vector<localNode*> region(clearedNodes);
+    uint frontBegin = 0;
+    for (uint s = 0; s < steps; s++)
+    {
+        uint frontEnd = region.size();
+        for (uint n = frontBegin; n < frontEnd; n++)
+            for (uint k = 0; k < 4; k++)
+            {
+                localNode* nb = region[n]->nb4List[k];
+                if ((nb != NULL)&&(nb->risk > 0)&&(inRegion.insert(nb).second))
+                    region.push_back(nb);
+            }
+        frontBegin = frontEnd;
+    }
+
+  // Their risk is recomputed from the remaining obstacles inside the region
+  // and from the risky nodes surrounding it
+    std::vector<localNode*> seeds(clearedNodes);
+    for (uint n = 0; n < region.size(); n++)
+        if (!region[n]->isObstacle)
+        {
+            region[n]->risk = 0;
+            markRiskDirty(getParentNode(region[n]));
+        }
+    for (uint n = 0; n < region.size(); n++)
+    {
+        if (region[n]->isObstacle)
+            seeds.push_back(region[n]);
+        for (uint k = 0; k < 4; k++)
+        {
+            localNode* nb = region[n]->nb4List[k];
+            if ((nb != NULL)&&(nb->risk > 0)&&(inRegion.count(nb) == 0))
+                seeds.push_back(nb);
+        }
+    }
+
+    std::vector<localNode*> pendingObstacles;
+    pendingObstacles.swap(localExpandableObstacles);
+    localExpandableObstacles.swap(seeds);
+    expandRisk();
+    localExpandableObstacles.swap(pendingObstacles);
+}
+
+bool PathPlanning::cutBlockedPath(std::vector<base::Waypoint>& trajectory,
+                                  uint minIndex, uint maxIndex,
+                                  uint& indexLim, double& Treach)
+{
+    PLANNER_INFO("trajectory from waypoint " << minIndex << " to waypoint " << maxIndex << " must be repaired");
+    PLANNER_DEBUG("size of globalPath is " << globalPath.size());
+    indexLim = findRepairStart(minIndex);
+
+    if(maxIndex >= globalPath.size()-1) //This means last waypoint is on forbidden area
+    {
+        /*trajectory.resize(minIndex);
+        isGlobalWaypoint.resize(minIndex);
+        std::cout << "PLANNER: trajectory is shortened due to goal placed on forbidden area" << std::endl;
+        return true;*/
+        cutGlobalPath(trajectory, indexLim);
+        PLANNER_WARNING("trajectory is shortened due to goal placed on forbidden area");
+        return false;
+    }
+    else
+    {
+        Treach = getInterpolatedCost(globalPath[maxIndex]);
+      // The local propagation is bounded to the blocked segment plus a margin
+        base::Vector2d regionMin(INF,INF), regionMax(-INF,-INF);
+        for(uint i = indexLim; i <= maxIndex; i++)
+        {
+            regionMin[0] = fmin(regionMin[0], globalPath[i].position[0]);
+            regionMin[1] = fmin(regionMin[1], globalPath[i].position[1]);
+            regionMax[0] = fmax(regionMax[0], globalPath[i].position[0]);
+            regionMax[1] = fmax(regionMax[1], globalPath[i].position[1]);
+        }
+        regionMin -= base::Vector2d(localRegionMargin,localRegionMargin);
+        regionMax += base::Vector2d(localRegionMargin,localRegionMargin);
+        //Resize trajectory to eliminate non safe part of the trajectory
+        //Resize as well the globalPath pointers
+        cutGlobalPath(trajectory, indexLim);
+        PLANNER_DEBUG("global Path is repaired from " << indexLim);
+        PLANNER_DEBUG("global Path size is " << globalPath.size());
+        PLANNER_DEBUG("trajectory is repaired from " << trajectory.size());
+        setLocalRegion(regionMin, regionMax);
+        return true;
+    }
+}
+
+uint PathPlanning::findRepairStart(uint minIndex)
+{
+  // Last waypoint before minIndex farther than 2*risk_distance from it. The
+  // straight distance never exceeds the arc length, so every waypoint
+  // within 2*risk_distance of arc length is skipped with a binary search
+    if (globalArcLength.size() != globalPath.size())
+        rebuildPathTables();
+    double arcLimit = globalArcLength[minIndex] - 2*risk_distance;
+    uint start = std::lower_bound(globalArcLength.begin(),
+                                  globalArcLength.begin() + minIndex,
+                                  arcLimit) - globalArcLength.begin();
+    start = std::min(start, minIndex);
+    for(uint i = start; i>0;i--)
+    {
+        if (sqrt(
+              pow(globalPath[i].position[0]-globalPath[minIndex].position[0],2)
+            + pow(globalPath[i].position[1]-globalPath[minIndex].position[1],2)
+          ) > 2*risk_distance)
+            return i;
+    }
+    return 0;
+}
+
+void PathPlanning::cutGlobalPath(std::vector<base::Waypoint>& trajectory, uint indexLim)
+{
+  // globalToTrajectory gives the trajectory waypoint of globalPath[indexLim]
+  // directly. The old search for an equal waypoint is only used when the
+  // trajectory passed is not the one the table was built for
+    uint cut = trajectory.size();
+    if ((indexLim < globalToTrajectory.size())&&
+        (globalToTrajectory[indexLim] < trajectory.size())&&
+        (trajectory[globalToTrajectory[indexLim]].position[0] == globalPath[indexLim].position[0])&&
+        (trajectory[globalToTrajectory[indexLim]].position[1] == globalPath[indexLim].position[1]))
+        cut = globalToTrajectory[indexLim];
+    else
+    {
+        for(uint i = 0; i<trajectory.size(); i++)
+        {
+            if ((trajectory[i].position[0] == globalPath[indexLim].position[0])&&
+                (trajectory[i].position[1] == globalPath[indexLim].position[1])&&
+                (trajectory[i].heading == globalPath[indexLim].heading))
+            {
+                cut = i;
+                break;
+            }
+        }
+    }
+    globalPath.resize(indexLim+1);
+    globalToTrajectory.resize(std::min((uint)globalToTrajectory.size(), indexLim+1));
+    globalArcLength.resize(std::min((uint)globalArcLength.size(), indexLim+1));
+    globalPathIndex.isValid = false;
+    globalCompactPath.isValid = false;
+    if (cut < trajectory.size())
+    {
+        trajectory.resize(cut+1);
+        if (globalToTrajectory.size() == indexLim+1)
+            globalToTrajectory[indexLim] = cut;
+    }
+}
+
+void PathPlanning::rebuildPathTables()
+{
+  // Fallback when globalPath was filled without the tables, the trajectory
+  // is then assumed to hold globalPath as it is
+    globalArcLength.resize(globalPath.size());
+    globalToTrajectory.resize(globalPath.size());
+    for (uint i = 0; i < globalPath.size(); i++)
+    {
+        globalArcLength[i] = (i == 0) ? 0 : globalArcLength[i-1] +
+            sqrt(pow(globalPath[i].position[0] - globalPath[i-1].position[0],2) +
+                 pow(globalPath[i].position[1] - globalPath[i-1].position[1],2));
+        globalToTrajectory[i] = i;
+    }
+}
+
+void PathPlanning::pushGlobalWaypoint(const base::Waypoint& wPos, uint trajectoryIndex)
+{
+    if (globalPath.empty())
+        globalArcLength.push_back(0);
+    else
+        globalArcLength.push_back(globalArcLength.back() +
+            sqrt(pow(wPos.position[0] - globalPath.back().position[0],2) +
+                 pow(wPos.position[1] - globalPath.back().position[1],2)));
+    globalToTrajectory.push_back(trajectoryIndex);
+    globalPath.push_back(wPos);
+}
+
+void PathPlanning::appendRepair(std::vector<base::Waypoint>& trajectory, localNode* lSet)
+{
+    getLocalPath(lSet,trajectory.back(),0.4,trajectory);
+    base::Waypoint newWaypoint;
+    newWaypoint.position[0] = lSet->global_pose.position[0];
+    newWaypoint.position[1] = lSet->global_pose.position[1];
+    getGlobalPath(newWaypoint,trajectory);
+}
+
+void PathPlanning::repairPath(std::vector<base::Waypoint>& trajectory, uint minIndex, uint maxIndex)
+{
+    uint indexLim;
+    double Treach;
+    anytimeRepair.isActive = false;
+    base::Time tRepair = base::Time::now();
+    if (!cutBlockedPath(trajectory, minIndex, maxIndex, indexLim, Treach))
+        return;
+    counters.repairs++;
+  //Trajectory is repaired from indexLim
+    localNode * lSet = calculateLocalPropagation(trajectory.back(),Treach,localStatus);
+    clearLocalRegion();
+    if (lSet == NULL)
+    {
+        PLANNER_ERROR("local repair failed with status " << localStatus
+                      << ", trajectory is shortened to the safe part");
+        counters.repairTime += (base::Time::now() - tRepair).toSeconds();
+        return;
+    }
+    appendRepair(trajectory, lSet);
+    counters.repairTime += (base::Time::now() - tRepair).toSeconds();
+}
+
+local_status PathPlanning::repairPathAnytime(std::vector<base::Waypoint>& trajectory,
+                                             uint minIndex, uint maxIndex,
+                                             double timeBudget)
+{
+    uint indexLim;
+    double Treach;
+    anytimeRepair.isActive = false;
+    base::Time tRepair = base::Time::now();
+    if (!cutBlockedPath(trajectory, minIndex, maxIndex, indexLim, Treach))
+    {
+        localStatus = LOCAL_EXHAUSTED;
+        return localStatus;
+    }
+    counters.repairs++;
+    anytimeRepair.cutSize = trajectory.size();
+    anytimeRepair.cutWaypoint = trajectory.back();
+    anytimeRepair.Treach = Treach;
+    anytimeRepair.regionMin = localRegionMin;
+    anytimeRepair.regionMax = localRegionMax;
+
+    double defaultBudget = localTimeBudget;
+    localTimeBudget = timeBudget;
+    localNode * lSet = calculateLocalPropagation(trajectory.back(),Treach,localStatus);
+    localTimeBudget = defaultBudget;
+    clearLocalRegion();
+    finishAnytimeRepair(trajectory, lSet);
+    counters.repairTime += (base::Time::now() - tRepair).toSeconds();
+    return localStatus;
+}
+
+local_status PathPlanning::continueRepair(std::vector<base::Waypoint>& trajectory,
+                                          double timeBudget)
+{
+    if (!anytimeRepair.isActive)
+        return localStatus;
+  // The partial repair appended after the cut is replaced, on the trajectory
+  // the repair was started on and only if it was not edited before the cut
+    const base::Waypoint& cut = anytimeRepair.cutWaypoint;
+    if ((anytimeRepair.cutSize == 0)||(trajectory.size() < anytimeRepair.cutSize)||
+        (trajectory[anytimeRepair.cutSize-1].position != cut.position)||
+        (trajectory[anytimeRepair.cutSize-1].heading != cut.heading))
+    {
+        anytimeRepair.isActive = false;
+        localStatus = LOCAL_CANCELLED;
+        PLANNER_WARNING("anytime repair cancelled, the trajectory is not the one being repaired");
+        return localStatus;
+    }
+    base::Time tRepair = base::Time::now();
+    trajectory.resize(anytimeRepair.cutSize);
+    setLocalRegion(anytimeRepair.regionMin, anytimeRepair.regionMax);
+
+    double defaultBudget = localTimeBudget;
+    localTimeBudget = timeBudget;
+    localNode * lSet;
+  // Without new risk the narrow band left by the last call is still valid,
+  // otherwise the warm start drops the invalidated part of the field
+    if ((localFieldSource == getLocalNode(trajectory.back()))&&
+        (localFieldEpoch == riskEpoch))
+    {
+        setLocalRegion(localFieldMin, localFieldMax);
+        lSet = marchLocalField(getInterpolatedCost(trajectory.back()),
+                               anytimeRepair.Treach, localFieldEnd, localStatus);
+        stampLocalField();
+    }
+    else
+        lSet = calculateLocalPropagation(trajectory.back(),anytimeRepair.Treach,localStatus);
+    localTimeBudget = defaultBudget;
+    finishAnytimeRepair(trajectory, lSet);
+    clearLocalRegion();
+    counters.repairTime += (base::Time::now() - tRepair).toSeconds();
+    return localStatus;
+}
+
+void PathPlanning::finishAnytimeRepair(std::vector<base::Waypoint>& trajectory,
+                                       localNode* lSet)
+{
+    if (lSet != NULL)
+    {
+        anytimeRepair.isActive = false;
+        appendRepair(trajectory, lSet);
+        return;
+    }
+    if (localStatus == LOCAL_EXHAUSTED)
+    {
+        anytimeRepair.isActive = false;
+        PLANNER_ERROR("local repair exhausted the region, trajectory is shortened to the safe part");
+        return;
+    }
+  // Out of time: the rover is sent towards the best node marched so far
+    anytimeRepair.isActive = true;
+    localNode * frontierNode = bestFrontierNode();
+    if (frontierNode != NULL)
+    {
+        getLocalPath(frontierNode,trajectory.back(),0.4,trajectory);
+        PLANNER_INFO("partial repair up to " << frontierNode->global_pose.position[0] << ","
+                     << frontierNode->global_pose.position[1]);
+    }
+}
+
+localNode* PathPlanning::bestFrontierNode()
+{
+  // Closed risk free nodes with a complete neighbourhood, so that the local
+  // gradient is defined, ranked by their remaining global cost
+    localNode * bestNode = NULL;
+    double bestCost = INF;
+    for (uint i = 0; i < local_closedNodes.size(); i++)
+    {
+        localNode * lNode = local_closedNodes[i];
+        if ((lNode->state != CLOSED)||(lNode->risk > 0)||(lNode == localFieldSource))
+            continue;
+        bool hasGradient = true;
+        for (uint k = 0; k < 4; k++)
+            if ((lNode->nb4List[k] == NULL)||(lNode->nb4List[k]->total_cost >= INF))
+                hasGradient = false;
+        if (!hasGradient)
+            continue;
+        double globalCost = getInterpolatedCost(lNode);
+        if (globalCost < bestCost)
+        {
+            bestCost = globalCost;
+            bestNode = lNode;
+        }
+    }
+    return bestNode;
+}
+
+bool PathPlanning::isRepairPending()
+{
+    return anytimeRepair.isActive;
+}
+
+bool PathPlanning::evaluateLocalMap(base::Waypoint wPos,
+                                       std::vector< std::vector<double> >& costMatrix,
+                                       double res,
+                                       std::vector<base::Waypoint>& trajectory)
+{
+    t1 = base::Time::now();
+    uint a = (uint)(fmax(0,((wPos.position[1] - 4.0)/res)));
+    uint b = (uint)(fmin(costMatrix.size(),((wPos.position[1] + 4.0)/res)));
+    uint c = (uint)(fmax(0,((wPos.position[0] - 4.0)/res)));
+    uint d = (uint)(fmin(costMatrix[0].size(),((wPos.position[0] + 4.0)/res)));
+    std::vector<localNode*> localNodesToUpdate;
+    localNode* lNode;
+    globalNode* gNode;
+
+    localExpandableObstacles.clear(); //obstacles whose risk has to be expanded
+    beginRiskUpdate();
+
+  //Indexes of the minimum and maximum waypoints affected in the trajectory by obstacles
+    uint minIndex = globalPath.size(), maxIndex = 0;
+    bool isBlocked = false;
+
+    for (uint j = a; j < b; j++)
+    {
+        for (uint i = c; i < d; i++)
+        {
+            double dx = i*res - wPos.position[0];
+            double dy = j*res - wPos.position[1];
+            //if (initializing)
+            if (sqrt(pow(dx,2) + pow(dy,2)) < 3.0)
+            {
+                base::Pose2D pos;
+                pos.position[0] = i*res;
+                pos.position[1] = j*res;
+                if (costMatrix[j][i] == 0) //If pixel is obstacle
+                {
+                    lNode = getLocalNode(pos);
+                    if (!lNode->isObstacle)
+                    {
+                        lNode->isObstacle = true;
+                        localExpandableObstacles.push_back(lNode);
+                        lNode->risk = 1.0;
+                        counters.obstaclesIngested++;
+                        gNode = getNearestGlobalNode(lNode->parent_pose);
+                        markRiskDirty(gNode);
+                        gNode->obstacle_ratio += pow((1/ratio_scale),2);
+                        isBlocked = isBlockingObstacle(lNode, maxIndex, minIndex);//See here if its blocking (and which waypoint)
+                    }
+                }
+            }
+        }
+    }
+    //In case an obstacle is blocking, expand the Risk and start repairing
+    PLANNER_DEBUG("index = " << minIndex);
+    PLANNER_DEBUG("globalPath size = " << globalPath.size());
+
+    uint indexLim = 0;
+    if(minIndex < globalPath.size())
+    {
+        expandRisk();
+        repairPath(trajectory, minIndex, maxIndex);
+        return true;
+    }
+    /*if(minIndex < globalPath.size())
+    {
+        std::cout << "PLANNER: trajectory from waypoint " << minIndex << " to waypoint " << maxIndex << " must be repaired" << std::endl;
+        expandRisk();
+
+        for(uint i = minIndex; i>0;i--)
+        {
+            if (sqrt(
+                  pow(globalPath[i].position[0]-globalPath[minIndex].position[0],2)
+                + pow(globalPath[i].position[1]-globalPath[minIndex].position[1],2)
+              ) > 2*risk_distance)
+            {
+                indexLim = i;
+                break;
+            }
+        }
+
         if(maxIndex == globalPath.size()) //This means last waypoint is on forbidden area
         {
             globalPath.resize(indexLim+1);
@@ -869,25 +1752,397 @@ bool PathPlanning::evaluateLocalMap(base::Waypoint wPos,
     return false;
 }
 
+void PathPlanning::buildPathIndex()
+{
+  // Uniform grid over the bounding box of globalPath. Cells are at least
+  // risk_distance wide, so an obstacle only needs its own cell and the 8
+  // surrounding ones
+    pathGrid& grid = globalPathIndex;
+    grid.cellStart.clear();
+    grid.waypoints.clear();
+    grid.isValid = true;
+    if (globalPath.empty())
+    {
+        grid.width = 0;
+        grid.height = 0;
+        return;
+    }
+
+    double minX = globalPath[0].position[0], maxX = minX;
+    double minY = globalPath[0].position[1], maxY = minY;
+    for (uint i = 1; i < globalPath.size(); i++)
+    {
+        minX = fmin(minX, globalPath[i].position[0]);
+        maxX = fmax(maxX, globalPath[i].position[0]);
+        minY = fmin(minY, globalPath[i].position[1]);
+        maxY = fmax(maxY, globalPath[i].position[1]);
+    }
+    grid.origin[0] = minX;
+    grid.origin[1] = minY;
+    grid.cellSize = risk_distance;
+    while (((maxX-minX)/grid.cellSize + 1)*((maxY-minY)/grid.cellSize + 1) >
+           16.0*globalPath.size() + 1024)
+        grid.cellSize *= 2;
+    grid.width = (uint)((maxX-minX)/grid.cellSize) + 1;
+    grid.height = (uint)((maxY-minY)/grid.cellSize) + 1;
+
+  // Counting sort of waypoint indexes by cell, ascending inside each cell
+    std::vector<uint> waypointCell(globalPath.size());
+    grid.cellStart.assign(grid.width*grid.height + 1, 0);
+    for (uint i = 0; i < globalPath.size(); i++)
+    {
+        uint cx = std::min((uint)((globalPath[i].position[0]-minX)/grid.cellSize), grid.width-1);
+        uint cy = std::min((uint)((globalPath[i].position[1]-minY)/grid.cellSize), grid.height-1);
+        waypointCell[i] = cy*grid.width + cx;
+        grid.cellStart[waypointCell[i] + 1]++;
+    }
+    for (uint c = 0; c < grid.width*grid.height; c++)
+        grid.cellStart[c+1] += grid.cellStart[c];
+    std::vector<uint> fill(grid.cellStart.begin(), grid.cellStart.end()-1);
+    grid.waypoints.resize(globalPath.size());
+    for (uint i = 0; i < globalPath.size(); i++)
+        grid.waypoints[fill[waypointCell[i]]++] = i;
+}
+
 bool PathPlanning::isBlockingObstacle(localNode* obNode, uint& maxIndex, uint& minIndex)
 {
+  // Equivalent to scanning globalPath in order: minIndex is the first
+  // waypoint closer than risk_distance, maxIndex the first one after it that
+  // is not (or globalPath size if the path never leaves the obstacle area)
+    if (compactTolerance > 0)
+        return isBlockingSegment(obNode, maxIndex, minIndex);
+    if (!globalPathIndex.isValid)
+        buildPathIndex();
+    if (globalPath.empty())
+        return false;
+
+    const pathGrid& grid = globalPathIndex;
+    double obX = obNode->global_pose.position[0];
+    double obY = obNode->global_pose.position[1];
+    int cx = (int)floor((obX - grid.origin[0])/grid.cellSize);
+    int cy = (int)floor((obY - grid.origin[1])/grid.cellSize);
+
+    uint firstIndex = globalPath.size();
+    for (int j = std::max(cy-1,0); j <= std::min(cy+1,(int)grid.height-1); j++)
+        for (int i = std::max(cx-1,0); i <= std::min(cx+1,(int)grid.width-1); i++)
+        {
+            uint c = j*grid.width + i;
+            for (uint k = grid.cellStart[c]; k < grid.cellStart[c+1]; k++)
+            {
+                uint index = grid.waypoints[k];
+                if (index >= firstIndex)
+                    break;
+                if(sqrt(
+                    pow(obX-globalPath[index].position[0],2) +
+                    pow(obY-globalPath[index].position[1],2))
+                    < risk_distance)
+                    firstIndex = index;
+            }
+        }
+
+    if (firstIndex == globalPath.size())
+        return false;
+
+    minIndex = (firstIndex<minIndex)?firstIndex:minIndex;
+    for (uint i = firstIndex + 1; i < globalPath.size(); i++)
+    {
+        if(!(sqrt(
+            pow(obX-globalPath[i].position[0],2) +
+            pow(obY-globalPath[i].position[1],2))
+            < risk_distance))
+        {
+            maxIndex = (i>maxIndex)?i:maxIndex;
+            return true;
+        }
+    }
+    maxIndex = globalPath.size();
+    return true;
+}
+
+void PathPlanning::setCompactPath(double tolerance)
+{
+    compactTolerance = fmax(tolerance,0.0);
+    globalCompactPath.isValid = false;
+}
+
+const compactPath& PathPlanning::getCompactPath()
+{
+    if (!globalCompactPath.isValid)
+        buildCompactPath();
+    return globalCompactPath;
+}
+
+void PathPlanning::simplifyPath(const std::vector<base::Waypoint>& path,
+                                double tolerance, compactPath& compact)
+{
+  // Douglas-Peucker: every dropped waypoint is closer than tolerance to the
+  // segment joining the vertices kept around it. Packing to float adds at
+  // most half an ulp of the coordinates on top of that
+    compact.vertices.clear();
+    compact.sourceIndex.clear();
+    compact.tolerance = tolerance;
+    if (path.empty())
+        return;
+
+    std::vector<bool> keep(path.size(), false);
+    keep.front() = true;
+    keep.back() = true;
+    std::vector< std::pair<uint,uint> > pending;
+    if (path.size() > 2)
+        pending.push_back(std::make_pair(0, (uint)path.size()-1));
+    while (!pending.empty())
+    {
+        uint first = pending.back().first;
+        uint last = pending.back().second;
+        pending.pop_back();
+        double ax = path[first].position[0], ay = path[first].position[1];
+        double dx = path[last].position[0] - ax, dy = path[last].position[1] - ay;
+        double length2 = dx*dx + dy*dy;
+        double maxDistance = -1;
+        uint farthest = first;
+        for (uint i = first + 1; i < last; i++)
+        {
+            double px = path[i].position[0] - ax, py = path[i].position[1] - ay;
+            double t = (length2 > 0) ? fmin(fmax((px*dx + py*dy)/length2, 0.0), 1.0) : 0;
+            double distance = sqrt(pow(px - t*dx,2) + pow(py - t*dy,2));
+            if (distance > maxDistance)
+            {
+                maxDistance = distance;
+                farthest = i;
+            }
+        }
+        if (maxDistance > tolerance)
+        {
+            keep[farthest] = true;
+            if (farthest - first > 1)
+                pending.push_back(std::make_pair(first, farthest));
+            if (last - farthest > 1)
+                pending.push_back(std::make_pair(farthest, last));
+        }
+    }
+
+    for (uint i = 0; i < path.size(); i++)
+        if (keep[i])
+        {
+            compact.vertices.push_back((float)path[i].position[0]);
+            compact.vertices.push_back((float)path[i].position[1]);
+            compact.vertices.push_back((float)path[i].heading);
+            compact.sourceIndex.push_back(i);
+        }
+}
+
+void PathPlanning::unpackPath(const compactPath& compact, std::vector<base::Waypoint>& path)
+{
+    for (uint k = 0; k < compact.sourceIndex.size(); k++)
+    {
+        base::Waypoint wPos;
+        wPos.position[0] = compact.vertices[3*k];
+        wPos.position[1] = compact.vertices[3*k+1];
+        wPos.heading = compact.vertices[3*k+2];
+        path.push_back(wPos);
+    }
+}
+
+void PathPlanning::buildCompactPath()
+{
+  // Segments are hashed in every cell their bounding box, grown by the
+  // blocking distance, overlaps, so an obstacle only needs its own cell
+    compactPath& compact = globalCompactPath;
+    simplifyPath(globalPath, compactTolerance, compact);
+    compact.isValid = true;
+    pathGrid& grid = compact.segmentIndex;
+    grid.cellStart.clear();
+    grid.waypoints.clear();
+    grid.isValid = true;
+    uint segments = (compact.sourceIndex.size() > 1) ? compact.sourceIndex.size() - 1 : 0;
+    if (segments == 0)
+    {
+        grid.width = 0;
+        grid.height = 0;
+        return;
+    }
+
+    const std::vector<float>& v = compact.vertices;
+    double reach = risk_distance + compact.tolerance;
+    double minX = v[0], maxX = v[0], minY = v[1], maxY = v[1];
+    for (uint k = 1; k <= segments; k++)
+    {
+        minX = fmin(minX, v[3*k]);
+        maxX = fmax(maxX, v[3*k]);
+        minY = fmin(minY, v[3*k+1]);
+        maxY = fmax(maxY, v[3*k+1]);
+    }
+    minX -= reach;
+    minY -= reach;
+    maxX += reach;
+    maxY += reach;
+    grid.origin[0] = minX;
+    grid.origin[1] = minY;
+    grid.cellSize = reach;
+    while (((maxX-minX)/grid.cellSize + 1)*((maxY-minY)/grid.cellSize + 1) >
+           16.0*segments + 1024)
+        grid.cellSize *= 2;
+    grid.width = (uint)((maxX-minX)/grid.cellSize) + 1;
+    grid.height = (uint)((maxY-minY)/grid.cellSize) + 1;
+
+    std::vector<uint> cellRange(4*segments);
+    grid.cellStart.assign(grid.width*grid.height + 1, 0);
+    for (uint k = 0; k < segments; k++)
+    {
+        double x0 = fmin(v[3*k], v[3*k+3]) - reach, x1 = fmax(v[3*k], v[3*k+3]) + reach;
+        double y0 = fmin(v[3*k+1], v[3*k+4]) - reach, y1 = fmax(v[3*k+1], v[3*k+4]) + reach;
+        cellRange[4*k] = std::min((uint)fmax((x0-minX)/grid.cellSize,0.0), grid.width-1);
+        cellRange[4*k+1] = std::min((uint)fmax((x1-minX)/grid.cellSize,0.0), grid.width-1);
+        cellRange[4*k+2] = std::min((uint)fmax((y0-minY)/grid.cellSize,0.0), grid.height-1);
+        cellRange[4*k+3] = std::min((uint)fmax((y1-minY)/grid.cellSize,0.0), grid.height-1);
+        for (uint cy = cellRange[4*k+2]; cy <= cellRange[4*k+3]; cy++)
+            for (uint cx = cellRange[4*k]; cx <= cellRange[4*k+1]; cx++)
+                grid.cellStart[cy*grid.width + cx + 1]++;
+    }
+    for (uint c = 0; c < grid.width*grid.height; c++)
+        grid.cellStart[c+1] += grid.cellStart[c];
+    std::vector<uint> fill(grid.cellStart.begin(), grid.cellStart.end()-1);
+    grid.waypoints.resize(grid.cellStart.back());
+    for (uint k = 0; k < segments; k++)
+        for (uint cy = cellRange[4*k+2]; cy <= cellRange[4*k+3]; cy++)
+            for (uint cx = cellRange[4*k]; cx <= cellRange[4*k+1]; cx++)
+                grid.waypoints[fill[cy*grid.width + cx]++] = k;
+}
+
+double PathPlanning::segmentDistance(const compactPath& compact, uint segment,
+                                     double x, double y, double& t)
+{
+  // Distance to the segment, t is the parameter of the closest point
+    const float* v = &compact.vertices[3*segment];
+    double dx = v[3] - v[0], dy = v[4] - v[1];
+    double px = x - v[0], py = y - v[1];
+    double length2 = dx*dx + dy*dy;
+    t = (length2 > 0) ? fmin(fmax((px*dx + py*dy)/length2, 0.0), 1.0) : 0;
+    return sqrt(pow(px - t*dx,2) + pow(py - t*dy,2));
+}
+
+bool PathPlanning::isBlockingSegment(localNode* obNode, uint& maxIndex, uint& minIndex)
+{
+  // Same contract and result as isBlockingObstacle. The compact path finds
+  // the segments closer to the obstacle than risk_distance plus the
+  // tolerance, the only ones whose dropped waypoints can be within
+  // risk_distance, and those waypoints are tested exactly on globalPath
+    if (!globalCompactPath.isValid)
+        buildCompactPath();
+    const compactPath& compact = globalCompactPath;
+    const pathGrid& grid = compact.segmentIndex;
+    if (grid.waypoints.empty())
+        return false;
+
+    double obX = obNode->global_pose.position[0];
+    double obY = obNode->global_pose.position[1];
+    double reach = risk_distance + compact.tolerance;
+    int cx = (int)floor((obX - grid.origin[0])/grid.cellSize);
+    int cy = (int)floor((obY - grid.origin[1])/grid.cellSize);
+    if ((cx < 0)||(cy < 0)||(cx >= (int)grid.width)||(cy >= (int)grid.height))
+        return false;
+
+  // Segments are listed in path order in every cell
+    uint firstIndex = globalPath.size();
+    double t;
+    uint c = cy*grid.width + cx;
+    for (uint k = grid.cellStart[c]; (k < grid.cellStart[c+1])&&(firstIndex == globalPath.size()); k++)
+    {
+        uint segment = grid.waypoints[k];
+        if (!(segmentDistance(compact, segment, obX, obY, t) < reach))
+            continue;
+        for (uint index = compact.sourceIndex[segment]; index <= compact.sourceIndex[segment+1]; index++)
+            if(sqrt(
+                pow(obX-globalPath[index].position[0],2) +
+                pow(obY-globalPath[index].position[1],2))
+                < risk_distance)
+            {
+                firstIndex = index;
+                break;
+            }
+    }
+    if (firstIndex == globalPath.size())
+        return false;
+
+    minIndex = (firstIndex<minIndex)?firstIndex:minIndex;
+    for (uint i = firstIndex + 1; i < globalPath.size(); i++)
+    {
+        if(!(sqrt(
+            pow(obX-globalPath[i].position[0],2) +
+            pow(obY-globalPath[i].position[1],2))
+            < risk_distance))
+        {
+            maxIndex = (i>maxIndex)?i:maxIndex;
+            return true;
+        }
+    }
+    maxIndex = globalPath.size();
+    return true;
+}
+
+bool PathPlanning::hasSegmentNewRisk(const compactPath& compact, uint segment, uint sinceEpoch)
+{
+  // Whether a tile nearest to any waypoint dropped from the segment, all of
+  // them within the tolerance of it, changed its risk after sinceEpoch. When
+  // the tiles around the segment outnumber its waypoints it is cheaper to
+  // check the waypoints, so true is returned
+    const float* v = &compact.vertices[3*segment];
+    double margin = compact.tolerance + 0.01*global_cellSize;
+    int i0 = (int)floor((fmin(v[0], v[3]) - margin)/global_cellSize + 0.5);
+    int i1 = (int)floor((fmax(v[0], v[3]) + margin)/global_cellSize + 0.5);
+    int j0 = (int)floor((fmin(v[1], v[4]) - margin)/global_cellSize + 0.5);
+    int j1 = (int)floor((fmax(v[1], v[4]) + margin)/global_cellSize + 0.5);
+    i0 = std::max(i0, 0);
+    j0 = std::max(j0, 0);
+    i1 = std::min(i1, (int)globalMap[0].size() - 1);
+    j1 = std::min(j1, (int)globalMap.size() - 1);
+    if ((i1 < i0)||(j1 < j0))
+        return false;
+    uint waypoints = compact.sourceIndex[segment+1] - compact.sourceIndex[segment];
+    if ((uint)((i1-i0+1)*(j1-j0+1)) > waypoints)
+        return true;
+    for (int j = j0; j <= j1; j++)
+        for (int i = i0; i <= i1; i++)
+            if (globalMap[j][i]->riskEpoch > sinceEpoch)
+                return true;
+    return false;
+}
+
+void PathPlanning::evaluateCompactPath(std::vector<base::Waypoint>& trajectory, uint sinceEpoch)
+{
+  // evaluatePath where the waypoints of a whole compact segment are skipped
+  // at once when no tile around the segment has risk newer than sinceEpoch.
+  // The waypoints that are checked are the ones of globalPath, so the
+  // result is the same as with the dense path
+    if (!globalCompactPath.isValid)
+        buildCompactPath();
+    uint minIndex = 0, maxIndex = 0;
     bool isBlocked = false;
+    uint k = 0;
     for (uint i = 0; i < globalPath.size(); i++)
     {
-        /*std::cout << "PLANNER: distance = " << sqrt(
-            pow(obNode->global_pose.position[0]-globalPath[i].position[0],2) +
-            pow(obNode->global_pose.position[1]-globalPath[i].position[1],2)) << std::endl;
-        std::cout << "PLANNER: global pose = " << obNode->global_pose.position[0] << "," << obNode->global_pose.position[1]
-                  << " and global path position is " << globalPath[i].position[0] << "," << globalPath[i].position[1] << std::endl;*/
-        if(sqrt(
-            pow(obNode->global_pose.position[0]-globalPath[i].position[0],2) +
-            pow(obNode->global_pose.position[1]-globalPath[i].position[1],2))
-            < risk_distance)
+        if ((!isBlocked)&&(sinceEpoch > 0))
+        {
+            const compactPath& compact = globalCompactPath;
+            while ((k + 2 < compact.sourceIndex.size())&&(compact.sourceIndex[k+1] <= i))
+                k++;
+            if ((k + 1 < compact.sourceIndex.size())&&(compact.sourceIndex[k] == i)&&
+                (!hasSegmentNewRisk(compact, k, sinceEpoch)))
+            {
+                i = compact.sourceIndex[k+1] - 1;
+                continue;
+            }
+            globalNode* gNode = getNearestGlobalNode(globalPath[i]);
+            if ((gNode == NULL)||(gNode->riskEpoch <= sinceEpoch))
+                continue;
+        }
+        localNode* nearestNode = getLocalNode(globalPath[i]);
+        if(nearestNode->risk > 0.0)
         {
             if(!isBlocked)
             {
                 isBlocked = true;
-                minIndex = (i<minIndex)?i:minIndex;
+                minIndex = i;
             }
             else
                 maxIndex = (i>maxIndex)?i:maxIndex;
@@ -895,12 +2150,18 @@ bool PathPlanning::isBlockingObstacle(localNode* obNode, uint& maxIndex, uint& m
         else if (isBlocked)
         {
             maxIndex = (i>maxIndex)?i:maxIndex;
-            return isBlocked;
+            repairPath(trajectory, minIndex, maxIndex);
+            isBlocked = false;
+            buildCompactPath();
+            k = 0;
+            i = minIndex;
         }
     }
     if (isBlocked)
+    {
         maxIndex = globalPath.size();
-    return isBlocked;
+        repairPath(trajectory, minIndex, maxIndex);
+    }
 }
 
 void PathPlanning::setHorizonCost(localNode* horizonNode)
@@ -969,36 +2230,398 @@ double PathPlanning::getInterpolatedCost(base::Waypoint wInt)
     return w00 + (w10 - w00)*a + (w01 - w00)*b + (w11 + w00 - w10 - w01)*a*b;
 }
 
+globalNode* PathPlanning::getParentNode(localNode* lNode)
+{
+    return globalMap[(uint)lNode->parent_pose.position[1]][(uint)lNode->parent_pose.position[0]];
+}
+
+void PathPlanning::beginRiskUpdate()
+{
+    riskEpoch++;
+    riskUpdateEpoch = riskEpoch;
+    isRiskEpochObserved = false;
+    riskDirtyTiles.clear();
+}
+
+void PathPlanning::resumeRiskUpdate()
+{
+  // Risk written after riskEpoch was handed out is stamped with a newer
+  // epoch, so whoever kept the old one sees it. The tiles it changes stay
+  // in the dirty list of the current update
+    if (!isRiskEpochObserved)
+        return;
+    riskEpoch++;
+    isRiskEpochObserved = false;
+}
+
+void PathPlanning::markRiskDirty(globalNode* gNode)
+{
+    resumeRiskUpdate();
+    markRiskDirty(gNode, riskDirtyTiles);
+}
+
+void PathPlanning::markRiskDirty(globalNode* gNode, std::vector<globalNode*>& dirtyTiles)
+{
+    if (gNode->riskEpoch == riskEpoch)
+        return;
+    bool isListed = (gNode->riskEpoch >= riskUpdateEpoch);
+    gNode->riskEpoch = riskEpoch;
+    if (!isListed)
+        dirtyTiles.push_back(gNode);
+}
+
+uint PathPlanning::getRiskEpoch()
+{
+  // Every tile whose risk changes after this call gets a greater riskEpoch
+  // than the one returned
+    isRiskEpochObserved = true;
+    return riskEpoch;
+}
+
+const std::vector<globalNode*>& PathPlanning::getRiskDirtyTiles()
+{
+    return riskDirtyTiles;
+}
+
+bool PathPlanning::getRiskDirtyRegion(uint& minX, uint& minY, uint& maxX, uint& maxY)
+{
+    if (riskDirtyTiles.empty())
+        return false;
+    minX = maxX = (uint)riskDirtyTiles[0]->pose.position[0];
+    minY = maxY = (uint)riskDirtyTiles[0]->pose.position[1];
+    for (uint n = 1; n < riskDirtyTiles.size(); n++)
+    {
+        minX = std::min(minX, (uint)riskDirtyTiles[n]->pose.position[0]);
+        maxX = std::max(maxX, (uint)riskDirtyTiles[n]->pose.position[0]);
+        minY = std::min(minY, (uint)riskDirtyTiles[n]->pose.position[1]);
+        maxY = std::max(maxY, (uint)riskDirtyTiles[n]->pose.position[1]);
+    }
+    return true;
+}
+
+void PathPlanning::setRiskEngine(risk_engine engine)
+{
+    riskEngine = engine;
+}
+
+void PathPlanning::setRiskThreads(uint threads)
+{
+    riskThreads = std::max(threads,(uint)1);
+}
+
+uint PathPlanning::riskHaloTiles()
+{
+    return (uint)ceil(risk_distance/local_cellSize/ratio_scale);
+}
+
+void PathPlanning::partitionRiskGroups(const std::vector<localNode*>& seeds,
+                                       std::vector< std::vector<localNode*> >& groups)
+{
+  // Tiles holding seeds are joined when they are closer than two risk halos
+  // plus one tile, so different groups never write (or read the risk of)
+  // the same tile while expanding, as long as each group only writes the
+  // tiles within a halo of its own seed tiles
+    uint globalWidth = globalMap[0].size();
+    int reach = 2*riskHaloTiles() + 1;
+    std::vector<uint> tiles(seeds.size());
+    for (uint n = 0; n < seeds.size(); n++)
+        tiles[n] = (uint)seeds[n]->parent_pose.position[1]*globalWidth +
+                   (uint)seeds[n]->parent_pose.position[0];
+    std::vector<uint> uniqueTiles(tiles);
+    std::sort(uniqueTiles.begin(), uniqueTiles.end());
+    uniqueTiles.erase(std::unique(uniqueTiles.begin(), uniqueTiles.end()), uniqueTiles.end());
+
+    std::vector<uint> parent(uniqueTiles.size());
+    for (uint t = 0; t < parent.size(); t++)
+        parent[t] = t;
+    for (uint t = 0; t < uniqueTiles.size(); t++)
+    {
+        int tx = uniqueTiles[t]%globalWidth, ty = uniqueTiles[t]/globalWidth;
+        for (int dy = 0; dy <= reach; dy++)
+        {
+            if ((ty+dy) >= (int)globalMap.size())
+                break;
+            uint first = (ty+dy)*globalWidth + std::max(tx-reach,0);
+            uint last = (ty+dy)*globalWidth + std::min(tx+reach,(int)globalWidth-1);
+            std::vector<uint>::iterator it = std::lower_bound(uniqueTiles.begin(), uniqueTiles.end(), first);
+            for (; (it != uniqueTiles.end())&&(*it <= last); ++it)
+            {
+                uint a = t, b = it - uniqueTiles.begin();
+                while (parent[a] != a)
+                    a = parent[a] = parent[parent[a]];
+                while (parent[b] != b)
+                    b = parent[b] = parent[parent[b]];
+                if (a != b)
+                    parent[std::max(a,b)] = std::min(a,b);
+            }
+        }
+    }
+
+  // Groups are numbered in tile order and keep the order of the seeds
+    std::vector<int> groupOf(uniqueTiles.size(), -1);
+    groups.clear();
+    for (uint t = 0; t < uniqueTiles.size(); t++)
+    {
+        uint root = t;
+        while (parent[root] != root)
+            root = parent[root];
+        if (groupOf[root] < 0)
+        {
+            groupOf[root] = groups.size();
+            groups.push_back(std::vector<localNode*>());
+        }
+        groupOf[t] = groupOf[root];
+    }
+    for (uint n = 0; n < seeds.size(); n++)
+    {
+        uint t = std::lower_bound(uniqueTiles.begin(), uniqueTiles.end(), tiles[n]) - uniqueTiles.begin();
+        groups[groupOf[t]].push_back(seeds[n]);
+    }
+}
+
 void PathPlanning::expandRisk()
 {
+    if (localExpandableObstacles.empty())
+        return;
+    resumeRiskUpdate();
+
+    base::Time tRisk = base::Time::now();
+    std::vector< std::vector<localNode*> > groups;
+    partitionRiskGroups(localExpandableObstacles, groups);
+    localExpandableObstacles.clear();
+
+    uint threads = std::min(riskThreads, (uint)groups.size());
+    if (threads <= 1)
+    {
+        for (uint g = 0; g < groups.size(); g++)
+            counters.riskNodesExpanded += expandRiskGroup(groups[g], riskDirtyTiles);
+        counters.riskTime += (base::Time::now() - tRisk).toSeconds();
+        return;
+    }
+
+  // Groups are independent, each worker takes the next pending one
+    std::vector< std::vector<globalNode*> > groupDirtyTiles(groups.size());
+    std::vector<uint> groupExpanded(groups.size(), 0);
+    std::atomic<uint> nextGroup(0);
+    std::vector<std::thread> workers;
+    for (uint t = 0; t < threads; t++)
+        workers.push_back(std::thread([&]()
+        {
+            uint g;
+            while ((g = nextGroup++) < groups.size())
+                groupExpanded[g] = expandRiskGroup(groups[g], groupDirtyTiles[g]);
+        }));
+    for (uint t = 0; t < threads; t++)
+        workers[t].join();
+    for (uint g = 0; g < groups.size(); g++)
+    {
+        riskDirtyTiles.insert(riskDirtyTiles.end(), groupDirtyTiles[g].begin(), groupDirtyTiles[g].end());
+        counters.riskNodesExpanded += groupExpanded[g];
+    }
+    counters.riskTime += (base::Time::now() - tRisk).toSeconds();
+}
+
+uint PathPlanning::expandRiskGroup(std::vector<localNode*>& queue,
+                                   std::vector<globalNode*>& dirtyTiles)
+{
+  // Returns the number of nodes expanded
+    if (riskEngine == RISK_DISTANCE_TRANSFORM)
+        return expandRiskDistanceTransform(queue, dirtyTiles);
     localNode * nodeTarget;
-    while(!localExpandableObstacles.empty())
+    uint expanded = 0;
+    while(!queue.empty())
     {
-        nodeTarget = maxRiskNode();
+        nodeTarget = maxRiskNode(queue);
+        expanded++;
         //std::cout << "PLANNER: number of expandable nodes is " << localExpandableObstacles.size() <<" and current risk is " << nodeTarget->risk << std::endl;
         //std::cout << "PLANNER: expanding node " << nodeTarget->pose.position[0] << " " << nodeTarget->pose.position[1] << std::endl;
         for (uint i = 0; i<4; i++)
             if (nodeTarget->nb4List[i] != NULL)
-                propagateRisk(nodeTarget->nb4List[i]);
+                propagateRisk(nodeTarget->nb4List[i], queue, dirtyTiles);
+    }
+    return expanded;
+}
+
+// Squared euclidean distance transform of one row (Felzenszwalb and
+// Huttenlocher): d[q] = min over p of (q-p)^2 + f[p]
+static void distanceTransformRow(const float* f, float* d, uint n,
+                                 std::vector<int>& v, std::vector<double>& z)
+{
+    int k = 0;
+    v[0] = 0;
+    z[0] = -INF;
+    z[1] = INF;
+    for (int q = 1; q < (int)n; q++)
+    {
+        double s = ((f[q] + (double)q*q) - (f[v[k]] + (double)v[k]*v[k]))/(2.0*q - 2.0*v[k]);
+        while (s <= z[k])
+        {
+            k--;
+            s = ((f[q] + (double)q*q) - (f[v[k]] + (double)v[k]*v[k]))/(2.0*q - 2.0*v[k]);
+        }
+        k++;
+        v[k] = q;
+        z[k] = s;
+        z[k+1] = INF;
+    }
+    k = 0;
+    for (int q = 0; q < (int)n; q++)
+    {
+        while (z[k+1] < q)
+            k++;
+        d[q] = (float)((q - v[k])*(q - v[k]) + f[v[k]]);
+    }
+}
+
+void PathPlanning::expandRiskDistanceTransform()
+{
+    base::Time tRisk = base::Time::now();
+    counters.riskNodesExpanded += expandRiskDistanceTransform(localExpandableObstacles, riskDirtyTiles);
+    counters.riskTime += (base::Time::now() - tRisk).toSeconds();
+}
+
+uint PathPlanning::expandRiskDistanceTransform(std::vector<localNode*>& queue,
+                                               std::vector<globalNode*>& dirtyTiles)
+{
+  // Returns the number of local nodes whose risk was rewritten
+    if (queue.empty())
+        return 0;
+
+  // Tiles holding the expandable nodes. Risk is rewritten in them plus a
+  // halo of risk_distance, and obstacles are read up to one more halo away
+  // so the written values are exact. Only tiles within the halo of a seed
+  // tile are written, not the whole bounding window: the window of an L
+  // shaped group may contain tiles of another group
+    uint x0 = globalMap[0].size(), x1 = 0, y0 = globalMap.size(), y1 = 0;
+    std::vector<uint> seedTiles(queue.size());
+    for (uint n = 0; n < queue.size(); n++)
+    {
+        uint tx = (uint)queue[n]->parent_pose.position[0];
+        uint ty = (uint)queue[n]->parent_pose.position[1];
+        seedTiles[n] = ty*globalMap[0].size() + tx;
+        x0 = std::min(x0, tx);
+        x1 = std::max(x1, tx);
+        y0 = std::min(y0, ty);
+        y1 = std::max(y1, ty);
+    }
+    queue.clear();
+    std::sort(seedTiles.begin(), seedTiles.end());
+    seedTiles.erase(std::unique(seedTiles.begin(), seedTiles.end()), seedTiles.end());
+
+    uint halo = riskHaloTiles(); //Risk is 0 this far from an obstacle
+    uint wx0 = (x0 > halo)?x0-halo:0, wy0 = (y0 > halo)?y0-halo:0;
+    uint wx1 = std::min(x1+halo, (uint)globalMap[0].size()-1);
+    uint wy1 = std::min(y1+halo, (uint)globalMap.size()-1);
+    uint windowWidth = wx1-wx0+1;
+    std::vector<char> isWritable(windowWidth*(wy1-wy0+1), 0);
+    for (uint t = 0; t < seedTiles.size(); t++)
+    {
+        uint tx = seedTiles[t]%globalMap[0].size(), ty = seedTiles[t]/globalMap[0].size();
+        for (uint y = std::max(ty, wy0+halo)-halo; y <= std::min(ty+halo, wy1); y++)
+            for (uint x = std::max(tx, wx0+halo)-halo; x <= std::min(tx+halo, wx1); x++)
+                isWritable[(y-wy0)*windowWidth + (x-wx0)] = 1;
+    }
+    uint ox0 = (wx0 > halo)?wx0-halo:0, oy0 = (wy0 > halo)?wy0-halo:0;
+    uint ox1 = std::min(wx1+halo, (uint)globalMap[0].size()-1);
+    uint oy1 = std::min(wy1+halo, (uint)globalMap.size()-1);
+
+    uint width = (ox1-ox0+1)*ratio_scale;
+    uint height = (oy1-oy0+1)*ratio_scale;
+    float far = (float)(width + height);
+
+  // Obstacle mask, 0 on obstacles and far elsewhere
+    std::vector<float> grid(width*height, far);
+    for (uint ty = oy0; ty <= oy1; ty++)
+        for (uint tx = ox0; tx <= ox1; tx++)
+        {
+            globalNode* gNode = globalMap[ty][tx];
+            if (!gNode->hasLocalMap)
+                continue;
+            for (uint l = 0; l < ratio_scale; l++)
+            {
+                float* row = &grid[((ty-oy0)*ratio_scale + l)*width + (tx-ox0)*ratio_scale];
+                for (uint k = 0; k < ratio_scale; k++)
+                    if (gNode->localMap[l][k]->isObstacle)
+                        row[k] = 0;
+            }
+        }
+
+  // Column pass, one whole row at a time so the inner loops vectorize
+    for (uint y = 1; y < height; y++)
+    {
+        const float* previous = &grid[(y-1)*width];
+        float* row = &grid[y*width];
+        for (uint x = 0; x < width; x++)
+            row[x] = std::min(row[x], previous[x] + 1.0f);
+    }
+    for (int y = (int)height-2; y >= 0; y--)
+    {
+        const float* next = &grid[(y+1)*width];
+        float* row = &grid[y*width];
+        for (uint x = 0; x < width; x++)
+            row[x] = std::min(row[x], next[x] + 1.0f);
+    }
+    for (uint c = 0; c < grid.size(); c++)
+        grid[c] = grid[c]*grid[c];
+
+  // Row pass and conversion of distances into risk
+    std::vector<float> rowDistance(width);
+    std::vector<int> v(width);
+    std::vector<double> z(width+1);
+    float riskSlope = (float)(local_cellSize/risk_distance);
+    for (uint y = (wy0-oy0)*ratio_scale; y < (wy1-oy0+1)*ratio_scale; y++)
+    {
+        float* row = &grid[y*width];
+        distanceTransformRow(row, &rowDistance[0], width, v, z);
+        for (uint x = 0; x < width; x++)
+            row[x] = std::max(0.0f, 1.0f - sqrtf(rowDistance[x])*riskSlope);
     }
+
+    uint rewritten = 0;
+    for (uint ty = wy0; ty <= wy1; ty++)
+        for (uint tx = wx0; tx <= wx1; tx++)
+        {
+            globalNode* gNode = globalMap[ty][tx];
+            if ((!gNode->hasLocalMap)||(!isWritable[(ty-wy0)*windowWidth + (tx-wx0)]))
+                continue;
+            rewritten += ratio_scale*ratio_scale;
+            bool changed = false;
+            for (uint l = 0; l < ratio_scale; l++)
+            {
+                const float* row = &grid[((ty-oy0)*ratio_scale + l)*width + (tx-ox0)*ratio_scale];
+                for (uint k = 0; k < ratio_scale; k++)
+                {
+                    changed = changed || (gNode->localMap[l][k]->risk != row[k]);
+                    gNode->localMap[l][k]->risk = row[k];
+                }
+            }
+            if (changed)
+                markRiskDirty(gNode, dirtyTiles);
+        }
+    return rewritten;
 }
 
 localNode* PathPlanning::maxRiskNode()
 {
-    if (localExpandableObstacles.empty())
+    return maxRiskNode(localExpandableObstacles);
+}
+
+localNode* PathPlanning::maxRiskNode(std::vector<localNode*>& queue)
+{
+    if (queue.empty())
         return NULL;
-    localNode* nodePointer = localExpandableObstacles.front();
+    localNode* nodePointer = queue.front();
     uint index = 0;
-    double maxRisk = localExpandableObstacles.front()->risk;
+    double maxRisk = queue.front()->risk;
     //std::cout << "Size of Narrow Band is: " << this->narrowBand.size() << std::endl;
-    for (uint i =0; i < localExpandableObstacles.size(); i++)
+    for (uint i =0; i < queue.size(); i++)
     {
         if (maxRisk == 1)
             break;
-        if (localExpandableObstacles[i]->risk > maxRisk)
+        if (queue[i]->risk > maxRisk)
         {
-            maxRisk = localExpandableObstacles[i]->risk;
-            nodePointer = localExpandableObstacles[i];
+            maxRisk = queue[i]->risk;
+            nodePointer = queue[i];
             index = i;
             break;
         }
@@ -1006,11 +2629,19 @@ localNode* PathPlanning::maxRiskNode()
     /*std::cout << "PLANNER: next expandable node is  (" <<
         nodePointer->pose.position[0] << "," <<
         nodePointer->pose.position[1] << ")" << std::endl;*/
-    localExpandableObstacles.erase(localExpandableObstacles.begin() + index);
+    queue.erase(queue.begin() + index);
     return nodePointer;
 }
 
 void PathPlanning::propagateRisk(localNode* nodeTarget)
+{
+    resumeRiskUpdate();
+    propagateRisk(nodeTarget, localExpandableObstacles, riskDirtyTiles);
+}
+
+void PathPlanning::propagateRisk(localNode* nodeTarget,
+                                 std::vector<localNode*>& queue,
+                                 std::vector<globalNode*>& dirtyTiles)
 {
     double Ry,Rx;
     localNode * Ny0 = nodeTarget->nb4List[0];
@@ -1034,72 +2665,228 @@ void PathPlanning::propagateRisk(localNode* nodeTarget)
     if ((R>0)&&(R>nodeTarget->risk))
     {
         nodeTarget->risk = R;
-        localExpandableObstacles.push_back(nodeTarget);
+        markRiskDirty(getParentNode(nodeTarget), dirtyTiles);
+        queue.push_back(nodeTarget);
     }
 }
 
 
 base::samples::DistanceImage PathPlanning::getLocalTotalCostMap(base::Waypoint wPos)
 {
-    uint a = (uint)(fmax(0,wPos.position[1] - 4.0));
-    uint b = (uint)(fmin(globalMap.size(),wPos.position[1] + 4.0));
-    uint c = (uint)(fmax(0,wPos.position[0] - 4.0));
-    uint d = (uint)(fmin(globalMap[0].size(),wPos.position[0] + 4.0 ));
+    mapExport out;
+    exportLocalTotalCostMap(wPos, out);
+    return out.image;
+}
+
+base::samples::DistanceImage PathPlanning::getLocalRiskMap(base::Waypoint wPos)
+{
+    mapExport out;
+    exportLocalRiskMap(wPos, out);
+    return out.image;
+}
+
+void PathPlanning::exportGlobalTotalCostMap(mapExport& out)
+{
+    exportGlobalMap(out, true);
+}
 
-    base::samples::DistanceImage localTotalCostMap;
-    localTotalCostMap.setSize(ratio_scale*(1+d-c),ratio_scale*(1+b-a));
+void PathPlanning::exportGlobalCostMap(mapExport& out)
+{
+    exportGlobalMap(out, false);
+}
 
-    for (uint j = 0; j <= b-a; j++)
+void PathPlanning::exportLocalTotalCostMap(base::Waypoint wPos, mapExport& out)
+{
+    exportLocalMap(wPos, out, false);
+}
+
+void PathPlanning::exportLocalRiskMap(base::Waypoint wPos, mapExport& out)
+{
+    exportLocalMap(wPos, out, true);
+}
+
+void PathPlanning::exportGlobalMap(mapExport& out, bool totalCost)
+{
+  // total_cost changes as a whole with every propagation and cost with
+  // every new map, so the image is either rewritten or left as it is
+    uint width = globalMap[0].size();
+    uint height = globalMap.size();
+    out.regions.clear();
+    uint epoch = totalCost ? globalFieldEpoch : globalMapEpoch;
+    if ((out.isValid)&&(out.epoch == epoch)&&
+        (out.image.width == width)&&(out.image.height == height))
+        return;
+
+    out.image.setSize(width,height);
+    float* data = &out.image.data[0];
+    for (uint j = 0; j < height; j++)
+        for (uint i = 0; i < width; i++)
+            data[i + j*width] = totalCost ? globalMap[j][i]->total_cost : globalMap[j][i]->cost;
+    out.image.scale_x = global_cellSize;
+    out.image.scale_y = global_cellSize;
+    out.image.center_x = global_offset.position[0] + global_cellSize*0.5*width;
+    out.image.center_y = global_offset.position[1] + global_cellSize*0.5*height;
+    exportRegion full = {0, 0, width, height};
+    out.regions.push_back(full);
+    out.epoch = epoch;
+    out.originX = 0;
+    out.originY = 0;
+    out.isValid = true;
+}
+
+void PathPlanning::exportLocalMap(base::Waypoint wPos, mapExport& out, bool risk)
+{
+  // Only the tiles changed since the last export of out are written, the
+  // risk through riskEpoch and the local field through costEpoch. Each run
+  // of changed tiles in a row becomes one region
+    uint a = (uint)(fmax(0,wPos.position[1] - 4.0));
+    uint b = (uint)(fmin(globalMap.size()-1,wPos.position[1] + 4.0));
+    uint c = (uint)(fmax(0,wPos.position[0] - 4.0));
+    uint d = (uint)(fmin(globalMap[0].size()-1,wPos.position[0] + 4.0 ));
+    uint width = ratio_scale*(1+d-c);
+    uint height = ratio_scale*(1+b-a);
+
+    bool isFull = (!out.isValid)||(out.originX != c)||(out.originY != a)||
+                  (out.image.width != width)||(out.image.height != height);
+    if (isFull)
+        out.image.setSize(width,height);
+    out.regions.clear();
+    out.originX = c;
+    out.originY = a;
+
+    for (uint j = a; j <= b; j++)
     {
-        for (uint i = 0; i <= d-c; i++)
+        uint runStart = 0;
+        bool inRun = false;
+        for (uint i = c; i <= d + 1; i++)
         {
-            for (uint l = 0; l < ratio_scale; l++)
+            bool isDirty = false;
+            if (i <= d)
             {
-                for (uint k = 0; k < ratio_scale; k++)
-                {
-                    if (globalMap[j+a][i+c]->localMap[l][k]->total_cost == INF)
-                        localTotalCostMap.data[(ratio_scale*(i+1)-(ratio_scale-k)) + (ratio_scale*(j+1)-(ratio_scale-l))*(ratio_scale*(d-c+1))] = 0;
-                    else
-                        localTotalCostMap.data[(ratio_scale*(i+1)-(ratio_scale-k)) + (ratio_scale*(j+1)-(ratio_scale-l))*(ratio_scale*(d-c+1))] = (globalMap[j+a][i+c]->localMap[l][k]->total_cost);
-                }
+                uint tileEpoch = risk ? globalMap[j][i]->riskEpoch : globalMap[j][i]->costEpoch;
+                isDirty = isFull || (tileEpoch > out.epoch);
+                if (isDirty)
+                    writeLocalTile(&out.image.data[ratio_scale*(i-c) + ratio_scale*(j-a)*width],
+                                   width, i, j, risk);
+            }
+            if (isDirty && !inRun)
+            {
+                runStart = i;
+                inRun = true;
+            }
+            else if (!isDirty && inRun)
+            {
+                exportRegion region = {ratio_scale*(runStart-c), ratio_scale*(j-a),
+                                       ratio_scale*(i-runStart), ratio_scale};
+                out.regions.push_back(region);
+                inRun = false;
             }
         }
     }
-  localTotalCostMap.scale_x = local_cellSize;
-  localTotalCostMap.scale_y = local_cellSize;
-  localTotalCostMap.center_x = wPos.position[0];//TODO: non strictly correct
-  localTotalCostMap.center_y = wPos.position[1];
-  return localTotalCostMap;
+
+    if (!risk)
+    {
+        out.image.scale_x = local_cellSize;
+        out.image.scale_y = local_cellSize;
+        out.image.center_x = wPos.position[0];//TODO: non strictly correct
+        out.image.center_y = wPos.position[1];
+    }
+    out.epoch = risk ? getRiskEpoch() : localCostEpoch;
+    out.isValid = true;
 }
 
-base::samples::DistanceImage PathPlanning::getLocalRiskMap(base::Waypoint wPos)
+void PathPlanning::writeLocalTile(float* block, uint width, uint i, uint j, bool risk)
 {
-    uint a = (uint)(fmax(0,wPos.position[1] - 4.0));
-    uint b = (uint)(fmin(globalMap.size(),wPos.position[1] + 4.0));
-    uint c = (uint)(fmax(0,wPos.position[0] - 4.0));
-    uint d = (uint)(fmin(globalMap[0].size(),wPos.position[0] + 4.0 ));
-
-    base::samples::DistanceImage localRiskMap;
-    localRiskMap.setSize(ratio_scale*(1+d-c),ratio_scale*(1+b-a));
-
-    for (uint j = 0; j <= b-a; j++)
-    {
-        for (uint i = 0; i <= d-c; i++)
+  // Tile (i,j) into the ratio_scale x ratio_scale block starting at block, in
+  // an image width pixels wide. The local total cost is exported as 0 where
+  // it is INF, the risk scaled by 10000
+    globalNode * gNode = globalMap[j][i];
+    for (uint l = 0; l < ratio_scale; l++)
+        for (uint k = 0; k < ratio_scale; k++)
         {
-            for (uint l = 0; l < ratio_scale; l++)
+            double value = 0;
+            if (gNode->hasLocalMap)
             {
-                for (uint k = 0; k < ratio_scale; k++)
-                {
-                    localRiskMap.data[(ratio_scale*(i+1)-(ratio_scale-k)) + (ratio_scale*(j+1)-(ratio_scale-l))*(ratio_scale*(d-c+1))] = (globalMap[j+a][i+c]->localMap[l][k]->risk)*10000;
-                }
+                localNode * lNode = gNode->localMap[l][k];
+                if (risk)
+                    value = lNode->risk*10000;
+                else if (lNode->total_cost != INF)
+                    value = lNode->total_cost;
             }
+            block[k + l*width] = value;
         }
+}
+
+bool PathPlanning::publishGlobalTotalCostMap(MapPublisher& publisher)
+{
+  // Same image as exportGlobalTotalCostMap, written straight into the slot
+    uint width = globalMap[0].size();
+    uint height = globalMap.size();
+    float* data = publisher.beginPublish(MAP_IMAGE, width, height);
+    if (data == NULL)
+        return false;
+    mapSlotHeader* slot = publisher.getWritingHeader();
+    slot->scale_x = global_cellSize;
+    slot->scale_y = global_cellSize;
+    slot->center_x = global_offset.position[0] + global_cellSize*0.5*width;
+    slot->center_y = global_offset.position[1] + global_cellSize*0.5*height;
+    slot->time = base::Time::now().toMicroseconds();
+    for (uint j = 0; j < height; j++)
+        for (uint i = 0; i < width; i++)
+            data[i + j*width] = globalMap[j][i]->total_cost;
+    publisher.endPublish();
+    return true;
+}
+
+bool PathPlanning::publishLocalRiskMap(base::Waypoint wPos, MapPublisher& publisher)
+{
+  // Same window around wPos as exportLocalRiskMap, all of it is written
+    uint a = (uint)(fmax(0,wPos.position[1] - 4.0));
+    uint b = (uint)(fmin(globalMap.size()-1,wPos.position[1] + 4.0));
+    uint c = (uint)(fmax(0,wPos.position[0] - 4.0));
+    uint d = (uint)(fmin(globalMap[0].size()-1,wPos.position[0] + 4.0 ));
+    uint width = ratio_scale*(1+d-c);
+    uint height = ratio_scale*(1+b-a);
+    float* data = publisher.beginPublish(MAP_IMAGE, width, height);
+    if (data == NULL)
+        return false;
+    mapSlotHeader* slot = publisher.getWritingHeader();
+    slot->scale_x = local_cellSize;
+    slot->scale_y = local_cellSize;
+    slot->center_x = global_offset.position[0] + global_cellSize*(c + 0.5*(1+d-c));
+    slot->center_y = global_offset.position[1] + global_cellSize*(a + 0.5*(1+b-a));
+    slot->time = base::Time::now().toMicroseconds();
+    for (uint j = a; j <= b; j++)
+        for (uint i = c; i <= d; i++)
+            writeLocalTile(&data[ratio_scale*(i-c) + ratio_scale*(j-a)*width], width, i, j, true);
+    publisher.endPublish();
+    return true;
+}
+
+bool PathPlanning::publishPath(MapPublisher& publisher)
+{
+  // The waypoints of globalPath, the path evaluated against new obstacles
+    float* data = publisher.beginPublish(MAP_PATH, globalPath.size(), 4);
+    if (data == NULL)
+        return false;
+    publisher.getWritingHeader()->time = base::Time::now().toMicroseconds();
+    for (uint i = 0; i < globalPath.size(); i++)
+    {
+        data[4*i] = globalPath[i].position[0];
+        data[4*i+1] = globalPath[i].position[1];
+        data[4*i+2] = globalPath[i].position[2];
+        data[4*i+3] = globalPath[i].heading;
     }
-  /*localRiskMap.scale_x = local_cellSize;
-  localRiskMap.scale_y = local_cellSize;
-  localRiskMap.center_x = wPos.position[0];//TODO: non strictly correct
-  localRiskMap.center_y = wPos.position[1];*/
-  return localRiskMap;
+    publisher.endPublish();
+    return true;
+}
+
+void PathPlanning::stampLocalField()
+{
+  // Tiles holding nodes of the local field are marked as changed
+    localCostEpoch++;
+    for (uint i = 0; i < local_closedNodes.size(); i++)
+        getParentNode(local_closedNodes[i])->costEpoch = localCostEpoch;
 }
 
 /*envire::TraversabilityGrid* PathPlanning::getEnvireLocalState(base::Waypoint wPos)
@@ -1192,68 +2979,251 @@ base::samples::DistanceImage PathPlanning::getLocalRiskMap(base::Waypoint wPos)
 
 
 localNode * PathPlanning::calculateLocalPropagation(base::Waypoint wInit, double Treach)
+{
+    return calculateLocalPropagation(wInit, Treach, localStatus);
+}
+
+localNode * PathPlanning::calculateLocalPropagation(base::Waypoint wInit, double Treach,
+                                                    local_status& status)
 {
   //wInit is the waypoint from which the path is repaired
 
-    if(!local_closedNodes.empty())
+  // A new repair invalidates every cached safe entry
+    safeMaskEpoch++;
+
+    local_actualPose = getLocalNode(wInit);
+    localFieldEnd = NULL;
+
+  // The previous field is reused when it was marched from the same node and
+  // covers the requested region
+    bool warmStart = localWarmStart && (localFieldSource == local_actualPose) &&
+                     (localRegionMin[0] >= localFieldMin[0]) &&
+                     (localRegionMin[1] >= localFieldMin[1]) &&
+                     (localRegionMax[0] <= localFieldMax[0]) &&
+                     (localRegionMax[1] <= localFieldMax[1]);
+    if (warmStart)
     {
-    std::cout << "PLANNER: resetting previous closed nodes" << std::endl;
-        for (uint i = 0; i < local_closedNodes.size(); i++)
-        {
-            local_closedNodes[i]->state = OPEN;
-            local_closedNodes[i]->total_cost = INF;
-        }
-        local_closedNodes.clear();
+        localRegionMin = localFieldMin;
+        localRegionMax = localFieldMax;
+        warmStart = warmStartLocalField(Treach, localFieldEnd);
+    }
+    if (!warmStart)
+    {
+        resetLocalField();
+        localFieldMin = localRegionMin;
+        localFieldMax = localRegionMax;
+
+      // Initializing the Narrow Band
+        PLANNER_DEBUG("initializing Narrow Band");
+        local_actualPose->total_cost = 0;
+        local_closedNodes.push_back(local_actualPose);
+        pushLocalNode(local_actualPose);
     }
+    localFieldSource = local_actualPose;
+    localFieldEpoch = getRiskEpoch();
 
-  // Initializing the Narrow Band
-    std::cout << "PLANNER: initializing Narrow Band" << std::endl;
+    double Tstart = getInterpolatedCost(wInit);
+    PLANNER_DEBUG("Tstart = " << Tstart << " and Treach = " << Treach);
+    localNode * nodeEnd = marchLocalField(Tstart, Treach, localFieldEnd, status);
+    stampLocalField();
+    return nodeEnd;
+}
 
-    local_actualPose = getLocalNode(wInit);
-    local_narrowBand.clear();
-    local_narrowBand.push_back(getLocalNode(wInit));
-    local_actualPose->total_cost = 0;
-    local_actualPose->state = CLOSED;
-    local_closedNodes.push_back(local_actualPose);
+localNode * PathPlanning::marchLocalField(double Tstart, double Treach,
+                                          localNode*& nodeEnd, local_status& status)
+{
     localNode * nodeTarget;
-    localNode * nodeEnd = NULL;
     bool levelSetFound = false;
+    uint expandedNodes = 0;
 
-    double Tstart = getInterpolatedCost(wInit);
-    std::cout << "PLANNER: Tstart = " << Tstart << " and Treach = " << Treach << std::endl;
   // Propagation Loop
     t1 = base::Time::now();
-    std::cout << "PLANNER: starting local propagation loop" << std::endl;
+    counters.localPropagations++;
+    PLANNER_DEBUG("starting local propagation loop");
 
-    while(true)//TODO: Control this
+    while(!isLocalEndReached(nodeEnd))
     {
+        if (local_narrowBand.empty())
+        {
+            status = LOCAL_EXHAUSTED;
+            PLANNER_WARNING("local propagation exhausted the region after " << expandedNodes << " nodes");
+            return NULL;
+        }
         nodeTarget = minCostLocalNode();
         nodeTarget->state = CLOSED;
+        expandedNodes++;
+        counters.localNodesPopped++;
         for (uint i = 0; i<4; i++)
         {
-            /*if (nodeTarget->nb4List[i] == NULL)
-                std::cout<< "PLANNER: nodeTarget " << nodeTarget->global_pose.position[0] << "," << nodeTarget->global_pose.position[1] << "has a null neighbour " << i << std::endl;*/
-            if ((nodeTarget->nb4List[i] != NULL) &&
-                (nodeTarget->nb4List[i]->state == OPEN))
+            localNode * nb = nodeTarget->nb4List[i];
+            if ((nb != NULL) && (nb->state == OPEN) && isInLocalRegion(nb))
+            {
+                if (nb->total_cost == INF) //To later erase total cost value of non close nodes as well
+                    local_closedNodes.push_back(nb);
+                levelSetFound = propagateLocalNode(nb, Tstart, Treach);
+                if ((levelSetFound)&&(nodeEnd == NULL))
+                    nodeEnd = nb;
+            }
+        }
+        if ((localNodeBudget > 0)&&(expandedNodes >= localNodeBudget))
+        {
+            status = LOCAL_NODE_BUDGET;
+            PLANNER_INFO("local propagation stopped, " << expandedNodes << " nodes expanded");
+            return NULL;
+        }
+      // Reading the clock every node would cost more than the node itself
+        if ((localTimeBudget > 0)&&((expandedNodes & 255) == 0)&&
+            ((base::Time::now() - t1).toSeconds() > localTimeBudget))
+        {
+            status = LOCAL_TIME_BUDGET;
+            PLANNER_INFO("local propagation stopped after " << localTimeBudget << " s");
+            return NULL;
+        }
+    }
+
+    t1 = base::Time::now() - t1;
+    PLANNER_DEBUG("Computation Time: " << t1);
+    status = LOCAL_REACHED;
+    PLANNER_DEBUG("ended local propagation loop");
+    PLANNER_DEBUG("nodeEnd " << nodeEnd->global_pose.position[0] << "," << nodeEnd->global_pose.position[1] << "has risk " << nodeEnd->risk);
+    return nodeEnd;
+}
+
+bool PathPlanning::isLocalEndReached(localNode* nodeEnd)
+{
+  // The gradient at nodeEnd needs all its neighbours in the region closed
+    if ((nodeEnd == NULL)||(nodeEnd->state != CLOSED))
+        return false;
+    for (uint i = 0; i<4; i++)
+    {
+        localNode * nb = nodeEnd->nb4List[i];
+        if ((nb != NULL)&&(nb->state != CLOSED)&&isInLocalRegion(nb))
+            return false;
+    }
+    return true;
+}
+
+void PathPlanning::resetLocalField()
+{
+    stampLocalField();
+    if(!local_closedNodes.empty())
+    {
+    PLANNER_DEBUG("resetting previous closed nodes");
+        for (uint i = 0; i < local_closedNodes.size(); i++)
+        {
+            local_closedNodes[i]->state = OPEN;
+            local_closedNodes[i]->total_cost = INF;
+            local_closedNodes[i]->heapIndex = -1;
+        }
+        local_closedNodes.clear();
+    }
+    for (uint i = 0; i < local_narrowBand.size(); i++)
+        local_narrowBand[i]->heapIndex = -1;
+    local_narrowBand.clear();
+}
+
+bool PathPlanning::warmStartLocalField(double Treach, localNode*& nodeEnd)
+{
+    localCostEpoch++;
+  // A node depends only on its own risk and on the nodes closed before it,
+  // so every node cheaper than the cheapest one in a tile whose risk changed
+  // since the last march keeps its value
+    double Tinvalid = INF;
+    for (uint i = 0; i < local_closedNodes.size(); i++)
+    {
+        localNode * lNode = local_closedNodes[i];
+        if ((lNode->state == CLOSED)&&
+            (getParentNode(lNode)->riskEpoch > localFieldEpoch))
+            Tinvalid = fmin(Tinvalid, lNode->total_cost);
+    }
+
+    uint fieldSize = local_closedNodes.size();
+    std::vector<localNode*> retained;
+    for (uint i = 0; i < local_closedNodes.size(); i++)
+    {
+        localNode * lNode = local_closedNodes[i];
+        lNode->heapIndex = -1;
+        if ((lNode->state == CLOSED)&&(lNode->total_cost < Tinvalid))
+            retained.push_back(lNode);
+        else
+        {
+            lNode->state = OPEN;
+            lNode->total_cost = INF;
+            getParentNode(lNode)->costEpoch = localCostEpoch;
+        }
+    }
+    local_narrowBand.clear();
+    local_closedNodes.swap(retained);
+    PLANNER_DEBUG("warm start keeps " << local_closedNodes.size() << " of " << fieldSize << " nodes");
+    if (local_closedNodes.empty())
+        return false;
+
+  // The cheapest retained safe entry is the one the march would have found first
+    for (uint i = 0; i < local_closedNodes.size(); i++)
+        if (isSafeEntry(local_closedNodes[i], Treach) &&
+            ((nodeEnd == NULL)||(local_closedNodes[i]->total_cost < nodeEnd->total_cost)))
+            nodeEnd = local_closedNodes[i];
+
+  // The narrow band is rebuilt from the open neighbours of the retained nodes
+    uint retainedSize = local_closedNodes.size();
+    localNode * bandEnd = NULL;
+    for (uint i = 0; i < retainedSize; i++)
+        for (uint k = 0; k < 4; k++)
+        {
+            localNode * nb = local_closedNodes[i]->nb4List[k];
+            if ((nb != NULL) && (nb->state == OPEN) && isInLocalRegion(nb))
             {
-                levelSetFound = propagateLocalNode(nodeTarget->nb4List[i], Tstart, Treach);
-                if ((levelSetFound)&&(nodeEnd == NULL))
-                    nodeEnd = nodeTarget->nb4List[i];
-                local_closedNodes.push_back(nodeTarget->nb4List[i]);//To later erase total cost value of non close nodes as well!!!
+                if (nb->total_cost == INF)
+                    local_closedNodes.push_back(nb);
+                if (propagateLocalNode(nb, 0, Treach) &&
+                    ((bandEnd == NULL)||(nb->total_cost < bandEnd->total_cost)))
+                    bandEnd = nb;
             }
         }
-        if ((nodeEnd != NULL)&&(nodeEnd->state == CLOSED)&&
-            (nodeEnd->nb4List[0]->state == CLOSED)&&(nodeEnd->nb4List[2]->state == CLOSED)&&
-            (nodeEnd->nb4List[2]->state == CLOSED)&&(nodeEnd->nb4List[3]->state == CLOSED))
-        {
-            std::cout<< "PLANNER: ended local propagation loop" << std::endl;
-            t1 = base::Time::now() - t1;
-            std::cout<<"Computation Time: " << t1 <<std::endl;
-            std::cout<< "PLANNER: nodeEnd " << nodeEnd->global_pose.position[0] << "," << nodeEnd->global_pose.position[1] << "has risk " << nodeEnd->risk << std::endl;
-            return nodeEnd;
-        }
-    }
+    if (nodeEnd == NULL)
+        nodeEnd = bandEnd;
+    return true;
+}
+
+void PathPlanning::setLocalRegionMargin(double margin)
+{
+    localRegionMargin = fmax(margin,0.0);
+}
+
+void PathPlanning::setLocalBudget(uint maxNodes, double maxSeconds)
+{
+    localNodeBudget = maxNodes;
+    localTimeBudget = fmax(maxSeconds,0.0);
+}
+
+void PathPlanning::setLocalRegion(base::Vector2d regionMin, base::Vector2d regionMax)
+{
+    localRegionMin = regionMin;
+    localRegionMax = regionMax;
+}
+
+void PathPlanning::clearLocalRegion()
+{
+    localRegionMin = base::Vector2d(-INF,-INF);
+    localRegionMax = base::Vector2d(INF,INF);
+}
+
+bool PathPlanning::isInLocalRegion(localNode* lNode)
+{
+    return (lNode->global_pose.position[0] >= localRegionMin[0])&&
+           (lNode->global_pose.position[0] <= localRegionMax[0])&&
+           (lNode->global_pose.position[1] >= localRegionMin[1])&&
+           (lNode->global_pose.position[1] <= localRegionMax[1]);
+}
+
+void PathPlanning::setLocalWarmStart(bool enabled)
+{
+    localWarmStart = enabled;
+}
 
+local_status PathPlanning::getLocalStatus()
+{
+    return localStatus;
 }
 
 bool PathPlanning::propagateLocalNode(localNode* nodeTarget, double Tstart, double Treach)
@@ -1279,37 +3249,11 @@ bool PathPlanning::propagateLocalNode(localNode* nodeTarget, double Tstart, doub
   //Cost Function
     R = nodeTarget->risk;
 
-    if ((getInterpolatedCost(nodeTarget) < Treach)&&(R == 0))
-    {
-        base::Waypoint wTarget;
-        base::Waypoint wNext;
-        localNode *nextLocal;
-        wTarget.position[0] = nodeTarget->global_pose.position[0];
-        wTarget.position[1] = nodeTarget->global_pose.position[1];
-        wNext = wTarget;
-        levelSetFound = true;
-        while(sqrt(pow((wTarget.position[0] - wNext.position[0]),2) +
-                 pow((wTarget.position[1] - wNext.position[1]),2)) <
-                 risk_distance*global_cellSize)
-        {
-            wNext = calculateNextGlobalWaypoint(wNext, risk_distance*global_cellSize);
-            nextLocal = getLocalNode(wNext);
-            if(nextLocal->risk > 0)
-            {
-                levelSetFound = false;
-                break;
-            }
-        }
-        if (levelSetFound)
-        {
-            std::cout << "Tnow = " << getInterpolatedCost(nodeTarget) << std::endl;
-            std::cout << "R = " << getInterpolatedCost(nodeTarget) << std::endl;
-        }
-    }
+    levelSetFound = isSafeEntry(nodeTarget, Treach);
     //C = h + 10*R + 0.1;
     C = R + 0.1;
     if(C <= 0)
-        std::cout << "PLANNER: ERROR, C is not positive" << std::endl;
+        PLANNER_ERROR("C is not positive");
 
   // Eikonal Equation
     if ((fabs(Tx-Ty)<C)&&(Tx < INF)&&(Ty < INF))
@@ -1319,38 +3263,127 @@ bool PathPlanning::propagateLocalNode(localNode* nodeTarget, double Tstart, doub
 
     if(T < nodeTarget->total_cost)
     {
-        if (nodeTarget->total_cost == INF) //It is not in narrowband
-            local_narrowBand.push_back(nodeTarget);
         nodeTarget->total_cost = T;
+        counters.localNodesUpdated++;
+        if (nodeTarget->heapIndex < 0) //It is not in narrowband
+            pushLocalNode(nodeTarget);
+        else
+            siftUpLocalNode(nodeTarget->heapIndex);
     }
     return levelSetFound;
 }
 
+bool PathPlanning::isSafeEntry(localNode* lNode, double Treach)
+{
+  // Risk and the global field do not change during a repair, so each node is
+  // evaluated once per safeMaskEpoch and later calls are a lookup
+    if (lNode->safeEpoch == safeMaskEpoch)
+        return lNode->isSafeEntry;
+    lNode->safeEpoch = safeMaskEpoch;
+    lNode->isSafeEntry = false;
+
+    if ((lNode->risk > 0)||(getInterpolatedCost(lNode) >= Treach))
+        return false;
+
+  // The global path leaving this node must stay risk free for risk_distance
+    base::Waypoint wTarget;
+    base::Waypoint wNext;
+    localNode *nextLocal;
+    wTarget.position[0] = lNode->global_pose.position[0];
+    wTarget.position[1] = lNode->global_pose.position[1];
+    wNext = wTarget;
+    while(sqrt(pow((wTarget.position[0] - wNext.position[0]),2) +
+             pow((wTarget.position[1] - wNext.position[1]),2)) <
+             risk_distance*global_cellSize)
+    {
+        wNext = calculateNextGlobalWaypoint(wNext, risk_distance*global_cellSize);
+        nextLocal = getLocalNode(wNext);
+        if(nextLocal->risk > 0)
+            return false;
+    }
+    PLANNER_DEBUG("Tnow = " << getInterpolatedCost(lNode));
+    lNode->isSafeEntry = true;
+    return true;
+}
+
 localNode* PathPlanning::minCostLocalNode()
 {
+  // local_narrowBand is a binary min-heap on total_cost
     localNode* nodePointer = local_narrowBand.front();
-    uint index = 0;
-    uint i;
-    double minCost = local_narrowBand.front()->total_cost;
-    //std::cout << "PLANNER: Size of Narrow Band is: " << local_narrowBand.size() << std::endl;
-    for (i =0; i < local_narrowBand.size(); i++)
+    nodePointer->heapIndex = -1;
+    localNode* lastNode = local_narrowBand.back();
+    local_narrowBand.pop_back();
+    if (!local_narrowBand.empty())
     {
-        if (local_narrowBand[i]->total_cost < minCost)
-        {
-            minCost = local_narrowBand[i]->total_cost;
-            nodePointer = local_narrowBand[i];
-            index = i;
-        }
+        local_narrowBand[0] = lastNode;
+        lastNode->heapIndex = 0;
+        siftDownLocalNode(0);
     }
-    local_narrowBand.erase(local_narrowBand.begin() + index);
     return nodePointer;
 }
 
+void PathPlanning::pushLocalNode(localNode* lNode)
+{
+    lNode->heapIndex = local_narrowBand.size();
+    local_narrowBand.push_back(lNode);
+    counters.localPeakNarrowBand = std::max(counters.localPeakNarrowBand,
+                                            (uint64_t)local_narrowBand.size());
+    siftUpLocalNode(lNode->heapIndex);
+}
+
+void PathPlanning::siftUpLocalNode(uint index)
+{
+    localNode* lNode = local_narrowBand[index];
+    while (index > 0)
+    {
+        uint parent = (index - 1)/2;
+        if (local_narrowBand[parent]->total_cost <= lNode->total_cost)
+            break;
+        local_narrowBand[index] = local_narrowBand[parent];
+        local_narrowBand[index]->heapIndex = index;
+        index = parent;
+    }
+    local_narrowBand[index] = lNode;
+    lNode->heapIndex = index;
+}
+
+void PathPlanning::siftDownLocalNode(uint index)
+{
+    localNode* lNode = local_narrowBand[index];
+    uint size = local_narrowBand.size();
+    while (2*index + 1 < size)
+    {
+        uint child = 2*index + 1;
+        if ((child + 1 < size)&&
+            (local_narrowBand[child+1]->total_cost < local_narrowBand[child]->total_cost))
+            child++;
+        if (lNode->total_cost <= local_narrowBand[child]->total_cost)
+            break;
+        local_narrowBand[index] = local_narrowBand[child];
+        local_narrowBand[index]->heapIndex = index;
+        index = child;
+    }
+    local_narrowBand[index] = lNode;
+    lNode->heapIndex = index;
+}
+
 
 std::vector<base::Waypoint> PathPlanning::getLocalPath(localNode * lSetNode,
                                                        base::Waypoint wInit,
                                                        double tau)
 {
+    std::vector<base::Waypoint> trajectory;
+    getLocalPath(lSetNode, wInit, tau, trajectory);
+    return trajectory;
+}
+
+void PathPlanning::getLocalPath(localNode * lSetNode,
+                                base::Waypoint wInit,
+                                double tau,
+                                std::vector<base::Waypoint>& trajectory)
+{
+  // The path is integrated from lSetNode back to wInit and appended to
+  // trajectory, then only the appended part is reversed
     base::Waypoint wPos;
     bool newWaypoint;
     wPos.position[0] = lSetNode->global_pose.position[0];
@@ -1358,82 +3391,240 @@ std::vector<base::Waypoint> PathPlanning::getLocalPath(localNode * lSetNode,
     wPos.heading = lSetNode->global_pose.orientation;
 
     tau = 0.5*local_cellSize;
-    std::vector<base::Waypoint> trajectory;
+    uint firstIndex = trajectory.size();
+    base::Time tExtraction = base::Time::now();
+    localExtraction = extractionStatistics();
     newWaypoint = calculateNextWaypoint(wPos, tau*local_cellSize);
-    trajectory.insert(trajectory.begin(),wPos);
-    std::cout << "PLANNER: repairing trajectory initialized" << std::endl;
-    std::cout << "PLANNER: lSetNode at " << wPos.position[0] << ", " << wPos.position[1] << std::endl;
-    std::cout << "PLANNER: wInit at " << wInit.position[0] << ", " << wInit.position[1] << std::endl;
-
-    while(sqrt(pow((trajectory.front().position[0] - wInit.position[0]),2) +
-             pow((trajectory.front().position[1] - wInit.position[1]),2)) > (local_cellSize))
+    localExtraction.gradientEvaluations++;
+    trajectory.push_back(wPos);
+    PLANNER_DEBUG("repairing trajectory initialized");
+    PLANNER_DEBUG("lSetNode at " << wPos.position[0] << ", " << wPos.position[1]);
+    PLANNER_DEBUG("wInit at " << wInit.position[0] << ", " << wInit.position[1]);
+
+    double step = tau;
+    double remaining;
+    while((remaining = sqrt(pow((trajectory.back().position[0] - wInit.position[0]),2) +
+             pow((trajectory.back().position[1] - wInit.position[1]),2))) > (local_cellSize))
     {
-        newWaypoint = calculateNextWaypoint(wPos, tau);
+        if (pathIntegrator == INTEGRATOR_EULER)
+        {
+            newWaypoint = calculateNextWaypoint(wPos, tau);
+            localExtraction.gradientEvaluations++;
+        }
+        else
+        {
+          // Risky cells are crossed with the smallest step
+            if (getLocalNode(wPos)->risk > 0)
+                step = tau;
+            step = fmin(step, fmax(tau, remaining));
+            wPos = integrateStep(wPos, step, tau, integratorMaxScale*tau,
+                                 true, localExtraction);
+            newWaypoint = !((std::isnan(wPos.position[0]))||(std::isnan(wPos.position[1])));
+        }
         if (newWaypoint)
-            trajectory.insert(trajectory.begin(),wPos);
+            trajectory.push_back(wPos);
         else
-            return trajectory;
-        if (trajectory.size() > 999)//TODO: quit this
+            break;
+        if (trajectory.size() - firstIndex > 999)//TODO: quit this
         {
-            std::cout << "PLANNER: ERROR computing local trajectory" << std::endl;
-            return trajectory;
+            PLANNER_ERROR("computing local trajectory failed");
+            break;
         }
     }
-    return trajectory;
+    std::reverse(trajectory.begin() + firstIndex, trajectory.end());
+    localExtraction.waypoints = trajectory.size() - firstIndex;
+    localExtraction.time = (base::Time::now() - tExtraction).toSeconds();
 }
 
 std::vector<base::Waypoint> PathPlanning::getNewPath(base::Waypoint wPos)
 {
     globalPath.clear();
+    globalToTrajectory.clear();
+    globalArcLength.clear();
+    globalPathIndex.isValid = false;
+    globalCompactPath.isValid = false;
     return getGlobalPath(wPos);
 }
 
 std::vector<base::Waypoint> PathPlanning::getGlobalPath(base::Waypoint wPos)
 {
-      base::Waypoint sinkPoint;
-      base::Waypoint wNext;
-      sinkPoint.position[0] = global_goalNode->pose.position[0];
-      sinkPoint.position[1] = global_goalNode->pose.position[1];
-      sinkPoint.position[2] = global_goalNode->elevation;
-      sinkPoint.heading = global_goalNode->pose.orientation;
+    std::vector<base::Waypoint> trajectory;
+    getGlobalPath(wPos, trajectory);
+    return trajectory;
+}
+
+void PathPlanning::getGlobalPath(base::Waypoint wPos, std::vector<base::Waypoint>& trajectory)
+{
+    pathStream stream;
+    beginGlobalPath(wPos, stream);
+    while (streamGlobalPath(stream, trajectory, 0) > 0);
+}
+
+void PathPlanning::beginGlobalPath(base::Waypoint wPos, pathStream& stream)
+{
+    stream.sinkPoint.position[0] = global_goalNode->pose.position[0];
+    stream.sinkPoint.position[1] = global_goalNode->pose.position[1];
+    stream.sinkPoint.position[2] = global_goalNode->elevation;
+    stream.sinkPoint.heading = global_goalNode->pose.orientation;
+    stream.wPos = wPos;
+    stream.tau = std::min(0.5,risk_distance);
+    stream.step = stream.tau*global_cellSize;
+    stream.yielded = 0;
+    stream.isFinished = false;
+    globalExtraction = extractionStatistics();
+    globalPathIndex.isValid = false;
+    globalCompactPath.isValid = false;
+    PLANNER_DEBUG("trajectory initialized with tau = " << stream.tau);
+}
 
-      std::vector<base::Waypoint> trajectory;
+uint PathPlanning::streamGlobalPath(pathStream& stream,
+                                    std::vector<base::Waypoint>& buffer,
+                                    uint maxWaypoints)
+{
+  // Yields up to maxWaypoints (all of them if 0) into buffer and globalPath,
+  // returns how many were yielded, 0 once the sink has been yielded
+    if (stream.isFinished)
+        return 0;
+    base::Time tExtraction = base::Time::now();
+    double tau = stream.tau;
+    base::Waypoint wNext;
+    uint count = 0;
+    while ((maxWaypoints == 0)||(count < maxWaypoints))
+    {
+        double remaining = sqrt(pow((stream.wPos.position[0] - stream.sinkPoint.position[0]),2) +
+                                pow((stream.wPos.position[1] - stream.sinkPoint.position[1]),2));
+      // The first waypoint is always yielded, even next to the sink
+        if ((stream.yielded > 0)&&(remaining <= global_cellSize))
+        {
+            PLANNER_DEBUG("Adding final waypoint with heading" << stream.sinkPoint.heading << " "<< globalPath.back().heading);
+            buffer.push_back(stream.sinkPoint);
+            pushGlobalWaypoint(stream.sinkPoint, buffer.size()-1);
+            stream.yielded++;
+            count++;
+            stream.isFinished = true;
+            buildPathIndex();
+            break;
+        }
+        if (pathIntegrator == INTEGRATOR_EULER)
+        {
+            wNext = calculateNextGlobalWaypoint(stream.wPos, tau*global_cellSize);
+            globalExtraction.gradientEvaluations++;
+        }
+        else
+        {
+          // Steps never go past the sink
+            stream.step = fmin(stream.step, fmax(tau*global_cellSize, remaining));
+            wNext = integrateStep(stream.wPos, stream.step, tau*global_cellSize,
+                                  integratorMaxScale*tau*global_cellSize,
+                                  false, globalExtraction);
+        }
+        buffer.push_back(stream.wPos);
+        pushGlobalWaypoint(stream.wPos, buffer.size()-1);
+        stream.yielded++;
+        count++;
+        if(stream.yielded>999999)//TODO: quit this
+        {
+            PLANNER_ERROR("trajectory extraction did not converge");
+            stream.isFinished = true;
+            break;
+        }
+        stream.wPos = wNext;
+    }
+    globalExtraction.waypoints = stream.yielded;
+    double extractionTime = (base::Time::now() - tExtraction).toSeconds();
+    globalExtraction.time += extractionTime;
+    counters.globalPathTime += extractionTime;
+    return count;
+}
 
-      trajectory.clear();
-      double tau = std::min(0.5,risk_distance);
-      wNext = calculateNextGlobalWaypoint(wPos, tau*global_cellSize);
-      trajectory.push_back(wPos);
-      wPos = wNext;
-      std::cout << "PLANNER: trajectory initialized with tau = " << tau << std::endl;
+bool PathPlanning::queryGlobalPath(pathQuery& query) const
+{
+  // Same descent as getGlobalPath with the Euler integrator, but it only
+  // reads globalGradient and total_cost: globalPath, the path index and the
+  // extraction statistics are left untouched, and nothing is logged
+    query.path.clear();
+    query.isValid = false;
+    query.expectedCost = INF;
+    const base::Waypoint& wStart = query.start;
+    if ((global_goalNode == NULL)||(!globalGradient.isValid)||
+        (!(wStart.position[0] >= 0))||(!(wStart.position[1] >= 0)))
+        return false;
 
+  // Interpolated as getInterpolatedCost, the corners must lie inside the map
+    uint i = (uint)(wStart.position[0]);
+    uint j = (uint)(wStart.position[1]);
+    if ((i + 1 >= globalMap[0].size())||(j + 1 >= globalMap.size()))
+        return false;
+    double a = wStart.position[0] - (double)(i);
+    double b = wStart.position[1] - (double)(j);
+    double w00 = globalMap[j][i]->total_cost;
+    double w10 = globalMap[j][i+1]->total_cost;
+    double w01 = globalMap[j+1][i]->total_cost;
+    double w11 = globalMap[j+1][i+1]->total_cost;
+    query.expectedCost = w00 + (w10 - w00)*a + (w01 - w00)*b + (w11 + w00 - w10 - w01)*a*b;
+    if (!(query.expectedCost < INF))
+        return false;
 
-      while(sqrt(pow((wPos.position[0] - sinkPoint.position[0]),2) +
-               pow((wPos.position[1] - sinkPoint.position[1]),2)) > global_cellSize)
-      {
-          wNext = calculateNextGlobalWaypoint(wPos, tau*global_cellSize);
-          trajectory.push_back(wPos);
-          if(trajectory.size()>999999)//TODO: quit this
-          {
-              std::cout << "PLANNER: ERROR in trajectory" << std::endl;
-              return trajectory;
-          }
-          wPos = wNext;
-      }
-      std::cout<< "PLANNER: Adding final waypoint with heading" << sinkPoint.heading << " "<< trajectory.back().heading<<  std::endl;
-      trajectory.push_back(sinkPoint);
+    base::Waypoint sinkPoint;
+    sinkPoint.position[0] = global_goalNode->pose.position[0];
+    sinkPoint.position[1] = global_goalNode->pose.position[1];
+    sinkPoint.position[2] = global_goalNode->elevation;
+    sinkPoint.heading = global_goalNode->pose.orientation;
+    double tau = std::min(0.5,risk_distance)*global_cellSize;
 
-      for(uint i = 0; i<trajectory.size(); i++)
-      {
-          globalPath.push_back(trajectory[i]);
-      }
-      return trajectory;
+    base::Waypoint wPos = wStart;
+    base::Waypoint wNext;
+    double dCostX, dCostY;
+    while (true)
+    {
+        if ((!query.path.empty())&&
+            (sqrt(pow((wPos.position[0] - sinkPoint.position[0]),2) +
+                  pow((wPos.position[1] - sinkPoint.position[1]),2)) <= global_cellSize))
+        {
+            query.path.push_back(sinkPoint);
+            query.isValid = true;
+            return true;
+        }
+        if (!fieldGradient(wPos, dCostX, dCostY, wPos.position[2]))
+            return false;
+        wNext.position[0] = wPos.position[0] - tau*dCostX;
+        wNext.position[1] = wPos.position[1] - tau*dCostY;
+        wNext.heading = atan2(-dCostY,-dCostX);
+        query.path.push_back(wPos);
+        if ((query.path.size() > 999999)||
+            (std::isnan(wNext.position[0]))||(std::isnan(wNext.position[1])))
+            return false;
+        wPos = wNext;
+    }
 }
 
-base::Waypoint PathPlanning::calculateNextGlobalWaypoint(base::Waypoint& wPos, double tau)
+void PathPlanning::queryGlobalPaths(std::vector<pathQuery>& queries, uint threads) const
 {
+  // Queries are independent, each worker takes the next pending one. The
+  // planner must not be modified while this runs
+    threads = std::min(std::max(threads, 1u), (uint)queries.size());
+    if (threads <= 1)
+    {
+        for (uint q = 0; q < queries.size(); q++)
+            queryGlobalPath(queries[q]);
+        return;
+    }
 
-    base::Waypoint wNext;
+    std::atomic<uint> nextQuery(0);
+    std::vector<std::thread> workers;
+    for (uint t = 0; t < threads; t++)
+        workers.push_back(std::thread([&]()
+        {
+            uint q;
+            while ((q = nextQuery++) < queries.size())
+                queryGlobalPath(queries[q]);
+        }));
+    for (uint t = 0; t < threads; t++)
+        workers[t].join();
+}
 
+void PathPlanning::globalDescentGradient(base::Waypoint& wPos, double& dCostX, double& dCostY)
+{
   // Position of wPos in terms of global units
     double globalXpos = (wPos.position[0]-global_offset.position[0]);
     double globalYpos = (wPos.position[1]-global_offset.position[1]);
@@ -1446,6 +3637,10 @@ base::Waypoint PathPlanning::calculateNextGlobalWaypoint(base::Waypoint& wPos, d
     double globalDistX = globalXpos - (double)(globalCornerX);
     double globalDistY = globalYpos - (double)(globalCornerY);
 
+  // Gradients and elevation from the precomputed field, no node is touched
+    if (fieldGradient(wPos, dCostX, dCostY, wPos.position[2]))
+        return;
+
   // Take pointers to global Nodes - corners of cell where wPos is
     globalNode * gNode00 = getGlobalNode(globalCornerX, globalCornerY);
     globalNode * gNode10 = gNode00->nb4List[2];
@@ -1460,12 +3655,52 @@ base::Waypoint PathPlanning::calculateNextGlobalWaypoint(base::Waypoint& wPos, d
     gradientNode( gNode01, gx01, gy01);
     gradientNode( gNode11, gx11, gy11);
 
-    double dCostX = interpolate(globalDistX,globalDistY,gx00,gx01,gx10,gx11);
-    double dCostY = interpolate(globalDistX,globalDistY,gy00,gy01,gy10,gy11);
+    dCostX = interpolate(globalDistX,globalDistY,gx00,gx01,gx10,gx11);
+    dCostY = interpolate(globalDistX,globalDistY,gy00,gy01,gy10,gy11);
 
     wPos.position[2] = interpolate(globalDistX,globalDistY,
                                    gNode00->elevation, gNode10->elevation,
                                    gNode01->elevation, gNode11->elevation);
+}
+
+bool PathPlanning::fieldGradient(const base::Waypoint& wPos, double& dCostX, double& dCostY,
+                                 double& elevation) const
+{
+  // Bilinear lookup in globalGradient, false outside of it
+    double globalXpos = (wPos.position[0]-global_offset.position[0]);
+    double globalYpos = (wPos.position[1]-global_offset.position[1]);
+    if ((!globalGradient.isValid)||(!(globalXpos >= 0))||(!(globalYpos >= 0)))
+        return false;
+    uint globalCornerX = (uint)(globalXpos/global_cellSize);
+    uint globalCornerY = (uint)(globalYpos/global_cellSize);
+    if ((globalCornerX + 1 >= globalGradient.width)||
+        (globalCornerY + 1 >= globalGradient.height))
+        return false;
+    double globalDistX = globalXpos - (double)(globalCornerX);
+    double globalDistY = globalYpos - (double)(globalCornerY);
+
+    uint index00 = globalCornerY*globalGradient.width + globalCornerX;
+    uint index01 = index00 + globalGradient.width;
+    const double* gx = &globalGradient.dx[0];
+    const double* gy = &globalGradient.dy[0];
+    const double* el = &globalGradient.elevation[0];
+
+    dCostX = interpolate(globalDistX,globalDistY,
+                         gx[index00],gx[index01],gx[index00+1],gx[index01+1]);
+    dCostY = interpolate(globalDistX,globalDistY,
+                         gy[index00],gy[index01],gy[index00+1],gy[index01+1]);
+    elevation = interpolate(globalDistX,globalDistY,
+                            el[index00], el[index00+1],
+                            el[index01], el[index01+1]);
+    return true;
+}
+
+base::Waypoint PathPlanning::calculateNextGlobalWaypoint(base::Waypoint& wPos, double tau)
+{
+
+    base::Waypoint wNext;
+    double dCostX, dCostY;
+    globalDescentGradient(wPos, dCostX, dCostY);
 
     wNext.position[0] = wPos.position[0] - tau*dCostX;///sqrt(pow(dCostX,2) + pow(dCostY,2));
     wNext.position[1] = wPos.position[1] - tau*dCostY;///sqrt(pow(dCostX,2) + pow(dCostY,2));
@@ -1477,7 +3712,7 @@ base::Waypoint PathPlanning::calculateNextGlobalWaypoint(base::Waypoint& wPos, d
     return wNext;
 }
 
-bool PathPlanning::calculateNextWaypoint(base::Waypoint& wPos, double tau)
+void PathPlanning::localDescentGradient(base::Waypoint& wPos, double& dCostX, double& dCostY)
 {
     double a,b;
 
@@ -1552,8 +3787,122 @@ bool PathPlanning::calculateNextWaypoint(base::Waypoint& wPos, double tau)
     gradientNode( node01, gx01, gy01);
     gradientNode( node11, gx11, gy11);
 
-    double dCostX = interpolate(a,b,gx00,gx01,gx10,gx11);
-    double dCostY = interpolate(a,b,gy00,gy01,gy10,gy11);
+    dCostX = interpolate(a,b,gx00,gx01,gx10,gx11);
+    dCostY = interpolate(a,b,gy00,gy01,gy10,gy11);
+}
+
+void PathPlanning::descentGradient(base::Waypoint& wPos, bool localField,
+                                   double& dCostX, double& dCostY)
+{
+    if (localField)
+        localDescentGradient(wPos, dCostX, dCostY);
+    else
+        globalDescentGradient(wPos, dCostX, dCostY);
+}
+
+base::Waypoint PathPlanning::integrateStep(base::Waypoint& wPos, double& step,
+                                           double minStep, double maxStep,
+                                           bool localField,
+                                           extractionStatistics& statistics)
+{
+    double k1x, k1y;
+    descentGradient(wPos, localField, k1x, k1y);
+    statistics.gradientEvaluations++;
+
+    base::Waypoint wNext = wPos;
+    base::Waypoint wStage = wPos;
+    double h, dx, dy, error;
+    while (true)
+    {
+        h = step;
+        if (pathIntegrator == INTEGRATOR_HEUN)
+        {
+            double k2x, k2y;
+            wStage.position[0] = wPos.position[0] - h*k1x;
+            wStage.position[1] = wPos.position[1] - h*k1y;
+            descentGradient(wStage, localField, k2x, k2y);
+            statistics.gradientEvaluations++;
+            dx = 0.5*(k1x + k2x);
+            dy = 0.5*(k1y + k2y);
+            error = 0.5*h*sqrt(pow(k2x - k1x,2) + pow(k2y - k1y,2));
+        }
+        else
+        {
+            double k2x, k2y, k3x, k3y, k4x, k4y;
+            wStage.position[0] = wPos.position[0] - 0.5*h*k1x;
+            wStage.position[1] = wPos.position[1] - 0.5*h*k1y;
+            descentGradient(wStage, localField, k2x, k2y);
+            wStage.position[0] = wPos.position[0] - 0.5*h*k2x;
+            wStage.position[1] = wPos.position[1] - 0.5*h*k2y;
+            descentGradient(wStage, localField, k3x, k3y);
+            wStage.position[0] = wPos.position[0] - h*k3x;
+            wStage.position[1] = wPos.position[1] - h*k3y;
+            descentGradient(wStage, localField, k4x, k4y);
+            statistics.gradientEvaluations += 3;
+            dx = (k1x + 2*k2x + 2*k3x + k4x)/6;
+            dy = (k1y + 2*k2y + 2*k3y + k4y)/6;
+            error = 0.5*h*sqrt(pow(k4x - k1x,2) + pow(k4y - k1y,2));
+        }
+      // The turn of the gradient along the step bounds the deviation from
+      // the true descent curve
+        if ((error > integratorTolerance)&&(step > minStep))
+        {
+            step = fmax(minStep, 0.5*step);
+            continue;
+        }
+        break;
+    }
+
+    wNext.position[0] = wPos.position[0] - h*dx;
+    wNext.position[1] = wPos.position[1] - h*dy;
+    if (localField)
+        wNext.heading = atan2(dy,dx);
+    else
+        wNext.heading = atan2(-dy,-dx);
+
+    if (error > 0)
+        step = h*fmin(2.0, 0.9*sqrt(integratorTolerance/error));
+    else
+        step = 2*h;
+    step = fmin(fmax(step, minStep), maxStep);
+    return wNext;
+}
+
+void PathPlanning::setPathIntegrator(path_integrator integrator)
+{
+    pathIntegrator = integrator;
+}
+
+void PathPlanning::setIntegratorTolerance(double tolerance, double maxStepScale)
+{
+    integratorTolerance = tolerance;
+    integratorMaxScale = fmax(maxStepScale, 1.0);
+}
+
+extractionStatistics PathPlanning::getGlobalExtractionStatistics()
+{
+    return globalExtraction;
+}
+
+extractionStatistics PathPlanning::getLocalExtractionStatistics()
+{
+    return localExtraction;
+}
+
+plannerCounters PathPlanning::getCounters()
+{
+    return counters;
+}
+
+void PathPlanning::resetCounters()
+{
+    counters = plannerCounters();
+}
+
+bool PathPlanning::calculateNextWaypoint(base::Waypoint& wPos, double tau)
+{
+    double dCostX, dCostY;
+    localDescentGradient(wPos, dCostX, dCostY);
 
     wPos.position[0] = wPos.position[0] - tau*dCostX;///sqrt(pow(dCostX,2) + pow(dCostY,2));
     wPos.position[1] = wPos.position[1] - tau*dCostY;///sqrt(pow(dCostX,2) + pow(dCostY,2));
@@ -1562,7 +3911,7 @@ bool PathPlanning::calculateNextWaypoint(base::Waypoint& wPos, double tau)
     if ((std::isnan(wPos.position[0]))||(std::isnan(wPos.position[1])))
     {
         return false;
-        std::cout << "PLANNER: ERROR, nan position" << std::endl;
+        PLANNER_ERROR("nan position");
     }
     return true;
 }
@@ -1656,7 +4005,7 @@ void PathPlanning::gradientNode(globalNode* nodeTarget, double& dnx, double& dny
       }
 }
 
-double PathPlanning::interpolate(double a, double b, double g00, double g01, double g10, double g11)
+double PathPlanning::interpolate(double a, double b, double g00, double g01, double g10, double g11) const
 {
     return g00 + (g10 - g00)*a + (g01 - g00)*b + (g11 + g00 - g10 - g01)*a*b;
 }
@@ -1664,68 +4013,148 @@ double PathPlanning::interpolate(double a, double b, double g00, double g01, dou
 
 std::string PathPlanning::getLocomotionMode(base::Waypoint wPos)
 {
-    if(locomotion_modes.size() > 1)
+  // Evaluated exactly at the heading of wPos, getLocomotionModes reads the
+  // heading binned locomotionTable instead
+    globalNode * gNode = getNearestGlobalNode(wPos);
+    if((locomotion_modes.size() > 1)&&(gNode != NULL))
+    {
+        uint locIndex;
+        bestLocomotionMode(gNode, wPos.heading, locIndex);
+        return locomotion_modes[locIndex];
+    }
+    else
+        return locomotion_modes[0];
+}
+
+void PathPlanning::getLocomotionModes(const std::vector<base::Waypoint>& trajectory,
+                                      std::vector<uint>& modes,
+                                      std::vector<double>& costs)
+{
+  // Index of locomotion_modes and cost of the best mode at each waypoint,
+  // read from locomotionTable. The heading is rounded to its bin, so near
+  // headings where two modes cost the same the mode may differ from the one
+  // getLocomotionMode gives. Waypoints outside the map get mode 0 and INF
+    if (!locomotionTable.isValid)
+        buildLocomotionTable();
+    const locomotionGrid& table = locomotionTable;
+    uint n = trajectory.size();
+    modes.resize(n);
+    costs.resize(n);
+
+  // First the table entry of every waypoint, then a single gather
+    std::vector<int> entry(n);
+    double binScale = table.headingBins/(2*M_PI);
+    for (uint k = 0; k < n; k++)
+    {
+        int i = (int)(trajectory[k].position[0]/global_cellSize + 0.5);
+        int j = (int)(trajectory[k].position[1]/global_cellSize + 0.5);
+        int bin = (int)((trajectory[k].heading + M_PI)*binScale);
+        bin = ((bin % (int)table.headingBins) + table.headingBins) % table.headingBins;
+        bool isInside = (i >= 0)&&(j >= 0)&&(i < (int)table.width)&&(j < (int)table.height);
+        entry[k] = isInside ? ((j*(int)table.width + i)*(int)table.headingBins + bin) : -1;
+    }
+    for (uint k = 0; k < n; k++)
     {
-        double Cdefinitive, Ccandidate, C1, C2;
-        int range = slope_range.size();
-        int numLocs = locomotion_modes.size();
-        int locIndex;
+        if (entry[k] < 0)
+        {
+            modes[k] = 0;
+            costs[k] = INF;
+            continue;
+        }
+        modes[k] = table.mode[entry[k]];
+        costs[k] = table.cost[entry[k]];
+    }
+}
 
-        globalNode * gNode = getNearestGlobalNode(wPos);
+double PathPlanning::bestLocomotionMode(globalNode* gNode, double heading, uint& locIndex)
+{
+  // Cheapest mode on the terrain of gNode, on slopes for the equivalent slope
+  // met when driving along heading. Returns its cost
+    double Cdefinitive, Ccandidate, C1, C2;
+    int range = slope_range.size();
+    int numLocs = locomotion_modes.size();
+    locIndex = 0;
 
-        if(range == 1) //Slopes are not taken into account
+    if(range == 1) //Slopes are not taken into account
+    {
+        Cdefinitive = cost_data[gNode->terrain*numLocs];
+        for(uint i = 1; i<locomotion_modes.size(); i++)
         {
-            Cdefinitive = cost_data[gNode->terrain*numLocs];
-            locIndex = 0;
-            for(uint i = 1; i<locomotion_modes.size(); i++)
+            Ccandidate = cost_data[gNode->terrain*numLocs + i];
+            if (Ccandidate < Cdefinitive)
             {
-                Ccandidate = cost_data[gNode->terrain*numLocs + i];
-                if (Ccandidate < Cdefinitive)
-                {
-                    Cdefinitive = Ccandidate;
-                    locIndex = i;
-                }
+                Cdefinitive = Ccandidate;
+                locIndex = i;
             }
-            return locomotion_modes[locIndex];
         }
-        else
-        {
-            double slopeEq, omega;
+        return Cdefinitive;
+    }
 
-            omega = acos(cos(gNode->aspect)*cos(wPos.heading)+sin(gNode->aspect)*sin(wPos.heading));
-            slopeEq = acos(sqrt(pow(cos(omega),2)*pow(cos(gNode->slope),2)+pow(sin(omega),2)));
+    double slopeEq, omega;
+    omega = acos(fmax(-1.0, fmin(1.0, cos(gNode->aspect)*cos(heading)+sin(gNode->aspect)*sin(heading))));
+    slopeEq = acos(fmin(1.0, sqrt(pow(cos(omega),2)*pow(cos(gNode->slope),2)+pow(sin(omega),2))));
 
-            std::cout << "PLANNER: equivalent slope is " << slopeEq << " with omega = " << omega << " and heading = " << wPos.heading << " and aspect = " << gNode->aspect << std::endl;
-            double slopeIndex = slopeEq*180/M_PI/(slope_range.back()-slope_range.front())*(slope_range.size()-1);
-            if(slopeIndex > (slope_range.size()-1))
-                slopeIndex = (slope_range.size()-1);
+    double slopeIndex = slopeEq*180/M_PI/(slope_range.back()-slope_range.front())*(slope_range.size()-1);
+    if(slopeIndex > (slope_range.size()-1))
+        slopeIndex = (slope_range.size()-1);
 
-            double slopeMinIndex = std::floor(slopeIndex);
-            double slopeMaxIndex = std::ceil(slopeIndex);
-            C1 = cost_data[gNode->terrain*range*numLocs + (int)slopeMinIndex];
-            C2 = cost_data[gNode->terrain*range*numLocs + (int)slopeMaxIndex];
-            Cdefinitive = C1 + (C2-C1)*(slopeIndex-slopeMinIndex);
-            locIndex = 0;
-                /*if((nodeTarget->terrain>0)&&((nodeTarget->slope)*180/M_PI<20.0)&&((nodeTarget->slope)*180/M_PI>10.0))
-                    std::cout << "PLANNER: checking cost -> " << Cdefinitive  << "and slopeIndex is" << slopeIndex << " and slopeMinIndex is " << slopeMinIndex <<
-                      " and slopeMaxIndex is " << slopeMaxIndex
-                      << " and C1 = " << C1 << " and C2 = " << C2 << std::endl;*/
-            for(uint i = 1; i<locomotion_modes.size();i++)
+    double slopeMinIndex = std::floor(slopeIndex);
+    double slopeMaxIndex = std::ceil(slopeIndex);
+    C1 = cost_data[gNode->terrain*range*numLocs + (int)slopeMinIndex];
+    C2 = cost_data[gNode->terrain*range*numLocs + (int)slopeMaxIndex];
+    Cdefinitive = C1 + (C2-C1)*(slopeIndex-slopeMinIndex);
+    for(uint i = 1; i<locomotion_modes.size();i++)
+    {
+        C1 = cost_data[gNode->terrain*range*numLocs + i*range + (int)slopeMinIndex];
+        C2 = cost_data[gNode->terrain*range*numLocs + i*range + (int)slopeMaxIndex];
+        Ccandidate = C1 + (C2-C1)*(slopeIndex-slopeMinIndex);
+        if (Ccandidate < Cdefinitive)
+        {
+            Cdefinitive = Ccandidate;
+            locIndex = i;
+        }
+    }
+    return Cdefinitive;
+}
+
+void PathPlanning::buildLocomotionTable()
+{
+  // Every bin holds the best mode and its cost for the heading at its
+  // centre. Without slopes the heading does not matter and one bin per
+  // node is enough
+    locomotionGrid& table = locomotionTable;
+    table.width = globalMap.empty() ? 0 : globalMap[0].size();
+    table.height = globalMap.size();
+    bool isHeadingFree = (slope_range.size() == 1);
+    table.headingBins = isHeadingFree ? 1 : std::max(locomotionHeadingBins, 1u);
+    table.mode.resize(table.width*table.height*table.headingBins);
+    table.cost.resize(table.mode.size());
+
+    uint locIndex;
+    for (uint j = 0; j < table.height; j++)
+        for (uint i = 0; i < table.width; i++)
+        {
+            uint entry = (j*table.width + i)*table.headingBins;
+            for (uint bin = 0; bin < table.headingBins; bin++)
             {
-                C1 = cost_data[gNode->terrain*range*numLocs + i*range + (int)slopeMinIndex];
-                C2 = cost_data[gNode->terrain*range*numLocs + i*range + (int)slopeMaxIndex];
-                Ccandidate = C1 + (C2-C1)*(slopeIndex-slopeMinIndex);
-                if (Ccandidate < Cdefinitive)
-                {
-                    Cdefinitive = Ccandidate;
-                    locIndex = i;
-                }
+                double heading = -M_PI + (bin + 0.5)*2*M_PI/table.headingBins;
+                table.cost[entry + bin] = bestLocomotionMode(globalMap[j][i], heading, locIndex);
+                table.mode[entry + bin] = (uint8_t)locIndex;
             }
-            return locomotion_modes[locIndex];
         }
-    }
-    else
-        return locomotion_modes[0];
+    table.isValid = true;
+}
+
+void PathPlanning::setLocomotionHeadingBins(uint bins)
+{
+    locomotionHeadingBins = std::max(bins, 1u);
+    if (locomotionTable.isValid)
+        buildLocomotionTable();
+}
+
+const locomotionGrid& PathPlanning::getLocomotionTable()
+{
+    return locomotionTable;
 }
 
 bool PathPlanning::isHorizon(localNode* lNode)
@@ -1738,33 +4167,22 @@ bool PathPlanning::isHorizon(localNode* lNode)
 
 void PathPlanning::evaluatePath(std::vector<base::Waypoint>& trajectory)
 {
-  // This tells whether the path is blocked or not, and between which waypoints
-    /*bool isBlocked = false;
-    localNode* nearestNode;
-    uint minIndex = 0; maxIndex = globalPath.size()-1;
-    for (uint i = minIndex; i < globalPath.size(); i++)
-    {
-        nearestNode = getLocalNode(trajectory[i]);
-        if (nearestNode->risk > 0.0)
-        {
-            if(!isBlocked)
-            {
-                isBlocked = true;
-                minIndex = (i<2)?0:(i-2);
-            }
-        }
-        else if (isBlocked)
-        {
-            maxIndex = (i>trajectory.size()-3)?i:(i+2);
-            break;
-        }
-    }
+    evaluatePath(trajectory, 0);
+}
 
-    if (minIndex != globalPath.size)
+void PathPlanning::evaluatePath(std::vector<base::Waypoint>& trajectory, uint sinceEpoch)
+{
+  // This tells whether the path is blocked or not, and between which waypoints.
+  // Waypoints on tiles whose risk did not change after sinceEpoch are not
+  // checked unless they continue a blocked stretch
 
-    return isBlocked;*/
+    PLANNER_DEBUG("Path is evaluated again");
 
-    std::cout << "PLANNER: Path is evaluated again" << std::endl;
+    if (compactTolerance > 0)
+    {
+        evaluateCompactPath(trajectory, sinceEpoch);
+        return;
+    }
 
     uint minIndex = 0, maxIndex = 0;
     bool isBlocked = false;
@@ -1772,13 +4190,19 @@ void PathPlanning::evaluatePath(std::vector<base::Waypoint>& trajectory)
 
         for (uint i = 0; i < globalPath.size(); i++)
         {
+            if ((!isBlocked)&&(sinceEpoch > 0))
+            {
+                globalNode* gNode = getNearestGlobalNode(globalPath[i]);
+                if ((gNode == NULL)||(gNode->riskEpoch <= sinceEpoch))
+                    continue;
+            }
             nearestNode = getLocalNode(globalPath[i]);
             if(nearestNode->risk > 0.0)
             {
                 if(!isBlocked)
                 {
                     isBlocked = true;
-                    minIndex = (i<minIndex)?i:minIndex;
+                    minIndex = i;
                 }
                 else
                     maxIndex = (i>maxIndex)?i:maxIndex;
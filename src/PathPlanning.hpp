@@ -28,6 +28,28 @@ namespace PathPlanning_lib
         HIDDEN
     };
 
+    enum risk_engine
+    {
+        RISK_EIKONAL, // Risk propagated node by node from the obstacles
+        RISK_DISTANCE_TRANSFORM // Risk from the exact distance to the obstacles
+    };
+
+    enum local_status
+    {
+        LOCAL_REACHED,     // A safe node of the global level set was reached
+        LOCAL_EXHAUSTED,   // The bounding region has no reachable safe node
+        LOCAL_NODE_BUDGET, // The budget of expanded nodes was consumed
+        LOCAL_TIME_BUDGET, // The budget of computation time was consumed
+        LOCAL_CANCELLED    // The trajectory given to continueRepair is not the one being repaired
+    };
+
+    enum path_integrator
+    {
+        INTEGRATOR_EULER, // Fixed steps of tau
+        INTEGRATOR_HEUN,  // Adaptive second order steps
+        INTEGRATOR_RK4    // Adaptive fourth order steps
+    };
+
     struct terrainType
     {
         double cost;
@@ -46,6 +68,9 @@ namespace PathPlanning_lib
         node_state state;
         std::vector<localNode*> nb4List;
         bool isObstacle;
+        int heapIndex; //Position in local_narrowBand, -1 when not in it
+        uint safeEpoch; //Repair in which isSafeEntry was evaluated
+        bool isSafeEntry; //Safe re-entry point into the global field
         localNode(uint x_, uint y_, base::Pose2D _parent_pose)
         {
             pose.position[0] = (double)x_;
@@ -55,6 +80,9 @@ namespace PathPlanning_lib
             risk = 0;
             total_cost = INF;
             isObstacle = false;
+            heapIndex = -1;
+            safeEpoch = 0;
+            isSafeEntry = false;
         }
     };
 
@@ -76,6 +104,8 @@ namespace PathPlanning_lib
         std::vector<globalNode*> nb4List;
         std::vector<globalNode*> nb8List;
         std::string nodeLocMode;
+        uint riskEpoch; //Last risk update that changed this tile
+        uint costEpoch; //Last local field change in this tile, see stampLocalField
         globalNode(uint x_, uint y_, double e_, double c_)
         {
             pose.position[0] = (double)x_;
@@ -90,9 +120,226 @@ namespace PathPlanning_lib
             state = OPEN;
             nodeLocMode = "DONT_CARE";
             obstacle_ratio = 0.0;
+            riskEpoch = 0;
+            costEpoch = 0;
+        }
+    };
+
+    struct pathGrid
+    {
+        double cellSize;
+        base::Vector2d origin;
+        uint width;
+        uint height;
+        std::vector<uint> cellStart; //Offset of each cell in waypoints (CSR)
+        std::vector<uint> waypoints; //Waypoint indexes sorted by cell
+        bool isValid;
+        pathGrid()
+        {
+            isValid = false;
+        }
+    };
+
+    struct compactPath
+    {
+        std::vector<float> vertices; //x, y and heading of each vertex, packed
+        std::vector<uint> sourceIndex; //Waypoint index of each vertex
+        double tolerance; //Maximum distance of a dropped waypoint to its segment
+        pathGrid segmentIndex; //Segment indexes by cell
+        bool isValid;
+        compactPath()
+        {
+            tolerance = 0;
+            isValid = false;
+        }
+    };
+
+    struct gradientGrid
+    {
+        uint width;
+        uint height;
+        std::vector<double> dx; //Normalized gradient of total_cost, row major
+        std::vector<double> dy;
+        std::vector<double> elevation;
+        bool isValid;
+        gradientGrid()
+        {
+            isValid = false;
+        }
+    };
+
+    struct extractionStatistics
+    {
+        double time; //In seconds
+        uint waypoints;
+        uint gradientEvaluations;
+        extractionStatistics()
+        {
+            time = 0;
+            waypoints = 0;
+            gradientEvaluations = 0;
         }
     };
 
+    // Accumulated since the last resetCounters, meant to be read and reset
+    // once per planning cycle. Updating them costs an increment per node
+    struct plannerCounters
+    {
+        uint64_t globalPropagations;
+        uint64_t globalNodesPopped; //Closed by the global propagation
+        uint64_t globalNodesUpdated; //Whose total_cost was lowered
+        uint64_t globalPeakNarrowBand;
+        uint64_t localPropagations; //Local marches, anytime continuations included
+        uint64_t localNodesPopped;
+        uint64_t localNodesUpdated;
+        uint64_t localPeakNarrowBand;
+        uint64_t localTilesCreated; //Global nodes given a local map
+        uint64_t obstaclesIngested; //New obstacle local nodes
+        uint64_t riskNodesExpanded; //Popped, or rewritten by the distance transform
+        uint64_t repairs; //Repairs started on a blocked path
+        double initTime; //Seconds spent in initGlobalMap
+        double globalPropagationTime;
+        double globalPathTime;
+        double ingestionTime;
+        double riskTime;
+        double repairTime;
+        plannerCounters()
+        {
+            globalPropagations = 0;
+            globalNodesPopped = 0;
+            globalNodesUpdated = 0;
+            globalPeakNarrowBand = 0;
+            localPropagations = 0;
+            localNodesPopped = 0;
+            localNodesUpdated = 0;
+            localPeakNarrowBand = 0;
+            localTilesCreated = 0;
+            obstaclesIngested = 0;
+            riskNodesExpanded = 0;
+            repairs = 0;
+            initTime = 0;
+            globalPropagationTime = 0;
+            globalPathTime = 0;
+            ingestionTime = 0;
+            riskTime = 0;
+            repairTime = 0;
+        }
+    };
+
+    struct locomotionGrid
+    {
+        uint width;
+        uint height;
+        uint headingBins; //1 when the cost does not depend on the heading
+        std::vector<uint8_t> mode; //Best locomotion mode per node and heading bin
+        std::vector<float> cost; //Cost of that mode
+        bool isValid;
+        locomotionGrid()
+        {
+            isValid = false;
+        }
+    };
+
+    struct locomotionLayers
+    {
+        uint width;
+        uint height;
+        uint modes;
+        std::vector<double> cost; //Nominal cost per mode and node, mode major
+        std::vector<double> total_cost; //Propagated cost per mode and node
+        bool isValid; //total_cost belongs to the last propagation
+        locomotionLayers()
+        {
+            width = 0;
+            height = 0;
+            modes = 0;
+            isValid = false;
+        }
+    };
+
+    struct exportRegion
+    {
+        uint x; //First column, in pixels of the exported image
+        uint y;
+        uint width;
+        uint height;
+    };
+
+    struct mapExport
+    {
+        base::samples::DistanceImage image; //Owned by the caller, reused every export
+        std::vector<exportRegion> regions; //Rectangles written by the last export
+        uint epoch; //Planner epoch the image is up to date with
+        uint originX; //Global node at the lower left pixel
+        uint originY;
+        bool isValid;
+        mapExport()
+        {
+            epoch = 0;
+            originX = 0;
+            originY = 0;
+            isValid = false;
+        }
+    };
+
+    struct pathQuery
+    {
+        base::Waypoint start; //Set by the caller
+        std::vector<base::Waypoint> path; //From start to the goal
+        double expectedCost; //Interpolated total_cost at start
+        bool isValid; //False if start is outside the field or unreachable
+        pathQuery()
+        {
+            expectedCost = 0;
+            isValid = false;
+        }
+    };
+
+    struct pathStream
+    {
+        base::Waypoint wPos; //Next waypoint to be yielded
+        base::Waypoint sinkPoint;
+        double tau;
+        double step;
+        uint yielded;
+        bool isFinished;
+        pathStream()
+        {
+            yielded = 0;
+            isFinished = true;
+        }
+    };
+
+    struct frameHistory
+    {
+        std::vector<uint8_t> obstacleMask; //1 where the pixel was obstacle
+        double offsetX;
+        double offsetY;
+        uint width;
+        uint height;
+        bool isValid;
+        frameHistory()
+        {
+            isValid = false;
+        }
+    };
+
+    struct anytimeRepairState
+    {
+        bool isActive; //A partial repair is waiting for continueRepair
+        uint cutSize; //Trajectory size once the blocked part is cut
+        base::Waypoint cutWaypoint; //Last waypoint kept by the cut
+        double Treach;
+        base::Vector2d regionMin;
+        base::Vector2d regionMax;
+        anytimeRepairState()
+        {
+            isActive = false;
+        }
+    };
+
+    class MapPublisher; //See MapPublisher.hpp
+
 //__PATH_PLANNER_CLASS__
     class PathPlanning
     {
@@ -108,6 +355,45 @@ namespace PathPlanning_lib
             globalNode* actualGlobalNodePos;
             std::vector<double> slope_range;
             std::vector<std::string> locomotion_modes;
+            bool deltaIngestion; //Only changed pixels of each frame are processed
+            frameHistory previousFrame;
+            risk_engine riskEngine;
+            uint riskEpoch;
+            uint riskUpdateEpoch; //riskEpoch when the current risk update began
+            bool isRiskEpochObserved; //riskEpoch was handed out, see getRiskEpoch
+            std::vector<globalNode*> riskDirtyTiles; //Tiles changed in the current risk update
+            uint riskThreads;
+            double localRegionMargin; //In Global Units, around the blocked segment
+            base::Vector2d localRegionMin; //Bounding region of the local propagation
+            base::Vector2d localRegionMax;
+            uint localNodeBudget; //Maximum expanded nodes, 0 means unbounded
+            double localTimeBudget; //Maximum seconds, 0 means unbounded
+            local_status localStatus;
+            uint safeMaskEpoch; //Current repair, stamps the safe entry mask
+            bool localWarmStart; //Repairs reuse the previous local field
+            localNode* localFieldSource; //Node the local field was marched from
+            localNode* localFieldEnd; //Safe entry found by the local field
+            uint localFieldEpoch; //riskEpoch when the local field was marched
+            base::Vector2d localFieldMin; //Region the local field was marched in
+            base::Vector2d localFieldMax;
+            anytimeRepairState anytimeRepair;
+            path_integrator pathIntegrator;
+            double integratorTolerance; //Maximum deviation per step, World Units
+            double integratorMaxScale; //Maximum step as a multiple of tau
+            extractionStatistics globalExtraction; //Last getGlobalPath
+            extractionStatistics localExtraction; //Last getLocalPath
+            double compactTolerance; //0 keeps blocking checks on the dense path
+            compactPath globalCompactPath; //Simplified globalPath
+            uint locomotionHeadingBins; //Heading bins of locomotionTable on slopes
+            locomotionGrid locomotionTable;
+            bool multiLayer; //One propagated layer per locomotion mode
+            double modeSwitchCost; //Added to total_cost when the mode changes
+            uint layerThreads;
+            locomotionLayers modeLayers;
+            uint globalFieldEpoch; //Counts global propagations
+            uint globalMapEpoch; //Counts calls to initGlobalMap
+            uint localCostEpoch; //Counts changes of the local field
+            plannerCounters counters;
         public:
             PathPlanning(std::vector< terrainType* > _table,
                          std::vector<double> costData,
@@ -126,6 +412,10 @@ namespace PathPlanning_lib
             std::vector<localNode*> local_closedNodes;
             //std::vector<base::Waypoint> trajectory;
             std::vector<base::Waypoint> globalPath;
+            pathGrid globalPathIndex; //Uniform grid hash of globalPath waypoints
+            std::vector<uint> globalToTrajectory; //Trajectory index of each globalPath waypoint
+            std::vector<double> globalArcLength; //Path length up to each globalPath waypoint
+            gradientGrid globalGradient; //Gradient of the global field per node
             std::vector<bool> isGlobalWaypoint;
             std::vector<double> cost_data;
 
@@ -158,12 +448,37 @@ namespace PathPlanning_lib
 
             void propagateGlobalNode(globalNode* nodeTarget);
 
+            void buildGradientField();
+
+            void setMultiLayerPropagation(bool enabled, double switchCost, uint threads);
+            void buildModeLayers();
+            void calculateLayeredPropagation();
+            bool marchModeLayer(uint mode, std::vector<uint>& seeds,
+                                plannerCounters& layerCounters);
+            double layerEikonal(uint mode, uint index);
+            uint bestLayerMode(uint index);
+            void getPathLocomotionModes(const std::vector<base::Waypoint>& path,
+                                        std::vector<uint>& modes);
+
             base::samples::DistanceImage getGlobalTotalCostMap();
             base::samples::DistanceImage getGlobalCostMap();
 
             base::samples::DistanceImage getLocalTotalCostMap(base::Waypoint wPos);
             base::samples::DistanceImage getLocalRiskMap(base::Waypoint wPos);
 
+            void exportGlobalTotalCostMap(mapExport& out);
+            void exportGlobalCostMap(mapExport& out);
+            void exportLocalTotalCostMap(base::Waypoint wPos, mapExport& out);
+            void exportLocalRiskMap(base::Waypoint wPos, mapExport& out);
+            void exportGlobalMap(mapExport& out, bool totalCost);
+            void exportLocalMap(base::Waypoint wPos, mapExport& out, bool risk);
+            void writeLocalTile(float* block, uint width, uint i, uint j, bool risk);
+
+            bool publishGlobalTotalCostMap(MapPublisher& publisher);
+            bool publishLocalRiskMap(base::Waypoint wPos, MapPublisher& publisher);
+            bool publishPath(MapPublisher& publisher);
+            void stampLocalField();
+
             void createLocalMap(globalNode* gNode);
 
             localNode* introducePixelInMap(base::Vector2d pos, bool& newVisible, std::vector<base::Waypoint>& trajectory);
@@ -186,15 +501,52 @@ namespace PathPlanning_lib
                                   std::vector<base::Waypoint>& trajectory);
 
             bool evaluateLocalMap(base::Waypoint wPos,
-                                  base::samples::frame::Frame traversabilityMap,
+                                  const base::samples::frame::Frame& traversabilityMap,
                                   double res,
                                   std::vector<base::Waypoint>& trajectory);
 
+            void setDeltaIngestion(bool enabled);
+
+            uint ingestTraversabilityMap(base::Waypoint wPos,
+                                         const base::samples::frame::Frame& traversabilityMap);
+
+            void retractRisk(const std::vector<localNode*>& clearedNodes);
+
+            globalNode* getParentNode(localNode* lNode);
+
+            void beginRiskUpdate();
+            void resumeRiskUpdate();
+            void markRiskDirty(globalNode* gNode);
+            void markRiskDirty(globalNode* gNode, std::vector<globalNode*>& dirtyTiles);
+            uint getRiskEpoch();
+            const std::vector<globalNode*>& getRiskDirtyTiles();
+            bool getRiskDirtyRegion(uint& minX, uint& minY, uint& maxX, uint& maxY);
+
+            void setRiskEngine(risk_engine engine);
+
+            void setRiskThreads(uint threads);
+
+            uint riskHaloTiles();
+
+            void partitionRiskGroups(const std::vector<localNode*>& seeds,
+                                     std::vector< std::vector<localNode*> >& groups);
+
             void expandRisk();
 
+            uint expandRiskGroup(std::vector<localNode*>& queue,
+                                 std::vector<globalNode*>& dirtyTiles);
+
+            void expandRiskDistanceTransform();
+            uint expandRiskDistanceTransform(std::vector<localNode*>& queue,
+                                             std::vector<globalNode*>& dirtyTiles);
+
             localNode* maxRiskNode();
+            localNode* maxRiskNode(std::vector<localNode*>& queue);
 
             void propagateRisk(localNode* nodeTarget);
+            void propagateRisk(localNode* nodeTarget,
+                               std::vector<localNode*>& queue,
+                               std::vector<globalNode*>& dirtyTiles);
 
             /*envire::TraversabilityGrid* getEnvireLocalState(base::Waypoint wPos);
 
@@ -207,35 +559,133 @@ namespace PathPlanning_lib
             double getInterpolatedCost(base::Waypoint wInt);
 
             localNode * calculateLocalPropagation(base::Waypoint wInit, double Treach);
+            localNode * calculateLocalPropagation(base::Waypoint wInit, double Treach,
+                                                  local_status& status);
+
+            localNode * marchLocalField(double Tstart, double Treach,
+                                        localNode*& nodeEnd, local_status& status);
+            bool isLocalEndReached(localNode* nodeEnd);
+            void resetLocalField();
+            bool warmStartLocalField(double Treach, localNode*& nodeEnd);
+            void setLocalWarmStart(bool enabled);
+
+            void setLocalRegionMargin(double margin);
+            void setLocalBudget(uint maxNodes, double maxSeconds);
+            void setLocalRegion(base::Vector2d regionMin, base::Vector2d regionMax);
+            void clearLocalRegion();
+            bool isInLocalRegion(localNode* lNode);
+            local_status getLocalStatus();
 
             bool propagateLocalNode(localNode* nodeTarget, double Tstart, double Treach);
 
+            bool isSafeEntry(localNode* lNode, double Treach);
+
             localNode* minCostLocalNode();
+            void pushLocalNode(localNode* lNode);
+            void siftUpLocalNode(uint index);
+            void siftDownLocalNode(uint index);
 
             std::vector<base::Waypoint> getLocalPath(localNode * lSetNode,
                                                      base::Waypoint wInit,
                                                      double tau);
             std::vector<base::Waypoint> getGlobalPath(base::Waypoint wPos);
 
+            void getLocalPath(localNode * lSetNode,
+                              base::Waypoint wInit,
+                              double tau,
+                              std::vector<base::Waypoint>& trajectory);
+            void getGlobalPath(base::Waypoint wPos, std::vector<base::Waypoint>& trajectory);
+
+            void beginGlobalPath(base::Waypoint wPos, pathStream& stream);
+            uint streamGlobalPath(pathStream& stream,
+                                  std::vector<base::Waypoint>& buffer,
+                                  uint maxWaypoints);
+
             std::vector<base::Waypoint> getNewPath(base::Waypoint wPos);
 
+            bool queryGlobalPath(pathQuery& query) const;
+            void queryGlobalPaths(std::vector<pathQuery>& queries, uint threads) const;
+            bool fieldGradient(const base::Waypoint& wPos, double& dCostX, double& dCostY,
+                               double& elevation) const;
+
             bool calculateNextWaypoint(base::Waypoint& wPos, double tau);
             base::Waypoint calculateNextGlobalWaypoint(base::Waypoint& wPos, double tau);
 
+            void globalDescentGradient(base::Waypoint& wPos, double& dCostX, double& dCostY);
+            void localDescentGradient(base::Waypoint& wPos, double& dCostX, double& dCostY);
+            void descentGradient(base::Waypoint& wPos, bool localField,
+                                 double& dCostX, double& dCostY);
+
+            base::Waypoint integrateStep(base::Waypoint& wPos, double& step,
+                                         double minStep, double maxStep,
+                                         bool localField,
+                                         extractionStatistics& statistics);
+
+            void setPathIntegrator(path_integrator integrator);
+            void setIntegratorTolerance(double tolerance, double maxStepScale);
+            extractionStatistics getGlobalExtractionStatistics();
+            extractionStatistics getLocalExtractionStatistics();
+
+            plannerCounters getCounters();
+            void resetCounters();
+
             void gradientNode(localNode* nodeTarget, double& dnx, double& dny);
             void gradientNode(globalNode* nodeTarget, double& dnx, double& dny);
 
-            double interpolate(double a, double b, double g00, double g01, double g10, double g11);
+            double interpolate(double a, double b, double g00, double g01, double g10, double g11) const;
 
             std::string getLocomotionMode(base::Waypoint wPos);
+            void getLocomotionModes(const std::vector<base::Waypoint>& trajectory,
+                                    std::vector<uint>& modes,
+                                    std::vector<double>& costs);
+            double bestLocomotionMode(globalNode* gNode, double heading, uint& locIndex);
+            void buildLocomotionTable();
+            void setLocomotionHeadingBins(uint bins);
+            const locomotionGrid& getLocomotionTable();
 
             void evaluatePath(std::vector<base::Waypoint>& trajectory);
+            void evaluatePath(std::vector<base::Waypoint>& trajectory, uint sinceEpoch);
 
             bool isHorizon(localNode* lNode);
 
+            void buildPathIndex();
+
             bool isBlockingObstacle(localNode* obNode, uint& maxIndex, uint& minIndex);
 
+            void setCompactPath(double tolerance);
+            const compactPath& getCompactPath();
+            void simplifyPath(const std::vector<base::Waypoint>& path,
+                              double tolerance, compactPath& compact);
+            void unpackPath(const compactPath& compact, std::vector<base::Waypoint>& path);
+            void buildCompactPath();
+            double segmentDistance(const compactPath& compact, uint segment,
+                                   double x, double y, double& t);
+            bool isBlockingSegment(localNode* obNode, uint& maxIndex, uint& minIndex);
+            bool hasSegmentNewRisk(const compactPath& compact, uint segment, uint sinceEpoch);
+            void evaluateCompactPath(std::vector<base::Waypoint>& trajectory, uint sinceEpoch);
+
+            bool cutBlockedPath(std::vector<base::Waypoint>& trajectory,
+                                uint minIndex, uint maxIndex,
+                                uint& indexLim, double& Treach);
+
+            uint findRepairStart(uint minIndex);
+            void cutGlobalPath(std::vector<base::Waypoint>& trajectory, uint indexLim);
+            void rebuildPathTables();
+            void pushGlobalWaypoint(const base::Waypoint& wPos, uint trajectoryIndex);
+
+            void appendRepair(std::vector<base::Waypoint>& trajectory, localNode* lSet);
+
             void repairPath(std::vector<base::Waypoint>& trajectory, uint minIndex, uint maxIndex);
+
+            local_status repairPathAnytime(std::vector<base::Waypoint>& trajectory,
+                                           uint minIndex, uint maxIndex,
+                                           double timeBudget);
+            local_status continueRepair(std::vector<base::Waypoint>& trajectory,
+                                        double timeBudget);
+            void finishAnytimeRepair(std::vector<base::Waypoint>& trajectory,
+                                     localNode* lSet);
+            localNode* bestFrontierNode();
+            bool isRepairPending();
     };
 
 } // end namespace motion_planning_libraries
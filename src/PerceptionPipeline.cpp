@@ -0,0 +1,269 @@
+#include "PerceptionPipeline.hpp"
+#include <math.h>
+#include <algorithm>
+
+using namespace PathPlanning_lib;
+
+void latencyHistogram::reset()
+{
+    for (uint i = 0; i < numBins; i++)
+        bins[i] = 0;
+    count = 0;
+    total = 0;
+    max = 0;
+}
+
+void latencyHistogram::add(base::Time latency)
+{
+    int64_t us = latency.toMicroseconds();
+    uint bin = 0;
+    while ((bin < numBins-1) && (us >= ((int64_t)1 << bin)))
+        bin++;
+    bins[bin]++;
+    count++;
+    total += latency.toSeconds();
+    max = std::max(max, latency.toSeconds());
+}
+
+double latencyHistogram::percentile(double p) const
+{
+    if (count == 0)
+        return 0;
+    uint64_t target = (uint64_t)ceil(p*count);
+    uint64_t accumulated = 0;
+    for (uint i = 0; i < numBins; i++)
+    {
+        accumulated += bins[i];
+        if (accumulated >= target)
+            return ((int64_t)1 << i)*1e-6;
+    }
+    return max;
+}
+
+
+PerceptionPipeline::PerceptionPipeline(PathPlanning* _planner,
+                                       uint queueCapacity,
+                                       queue_policy _policy):
+                                       planner(_planner), policy(_policy)
+{
+    running = false;
+    frameSlots.resize(std::max(queueCapacity,(uint)1));
+    queueHead = 0;
+    queueCount = 0;
+    pendingFrames = 0;
+    trajectoryVersion = 0;
+}
+
+PerceptionPipeline::~PerceptionPipeline()
+{
+    stop();
+}
+
+void PerceptionPipeline::start()
+{
+    if (running)
+        return;
+    running = true;
+    ingestionThread = std::thread(&PerceptionPipeline::ingestionLoop, this);
+    planningThread = std::thread(&PerceptionPipeline::planningLoop, this);
+}
+
+void PerceptionPipeline::stop()
+{
+    {
+        std::lock_guard<std::mutex> queueLock(queueMutex);
+        std::lock_guard<std::mutex> pendingLock(pendingMutex);
+        running = false;
+    }
+    queueNotEmpty.notify_all();
+    queueNotFull.notify_all();
+    pendingReady.notify_all();
+    if (ingestionThread.joinable())
+        ingestionThread.join();
+    if (planningThread.joinable())
+        planningThread.join();
+}
+
+bool PerceptionPipeline::pushFrame(base::Waypoint wPos,
+                                   const base::samples::frame::Frame& traversabilityMap)
+{
+    return enqueueFrame(wPos, traversabilityMap, true);
+}
+
+bool PerceptionPipeline::tryPushFrame(base::Waypoint wPos,
+                                      const base::samples::frame::Frame& traversabilityMap)
+{
+    return enqueueFrame(wPos, traversabilityMap, false);
+}
+
+bool PerceptionPipeline::enqueueFrame(base::Waypoint wPos,
+                                      const base::samples::frame::Frame& traversabilityMap,
+                                      bool wait)
+{
+    std::unique_lock<std::mutex> lock(queueMutex);
+    uint capacity = frameSlots.size();
+    uint dropped = 0;
+    if (queueCount == capacity)
+    {
+        if (policy == LATEST_FRAME_WINS)
+        {
+            queueHead = (queueHead + 1)%capacity;
+            queueCount--;
+            dropped = 1;
+        }
+        else if (wait)
+        {
+            queueNotFull.wait(lock, [this, capacity]{ return (queueCount < capacity)||(!running); });
+            if (!running)
+                return false;
+        }
+        else
+            return false;
+    }
+    frameRequest& slot = frameSlots[(queueHead + queueCount)%capacity];
+    slot.wPos = wPos;
+    slot.frame = traversabilityMap;
+    slot.stamp = base::Time::now();
+    queueCount++;
+    lock.unlock();
+    queueNotEmpty.notify_one();
+
+    std::lock_guard<std::mutex> statisticsLock(statisticsMutex);
+    statistics.framesReceived++;
+    statistics.framesDropped += dropped;
+    return true;
+}
+
+void PerceptionPipeline::ingestionLoop()
+{
+    frameRequest request;
+    std::vector<localNode*> newObstacles;
+    while (true)
+    {
+        uint dropped = 0;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueNotEmpty.wait(lock, [this]{ return (queueCount > 0)||(!running); });
+            if (!running)
+                return;
+            if ((policy == LATEST_FRAME_WINS)&&(queueCount > 1))
+            {
+                dropped = queueCount - 1;
+                queueHead = (queueHead + dropped)%frameSlots.size();
+                queueCount = 1;
+            }
+          // Swapping keeps both frame buffers allocated for the next frames
+            std::swap(request, frameSlots[queueHead]);
+            queueHead = (queueHead + 1)%frameSlots.size();
+            queueCount--;
+        }
+        queueNotFull.notify_all();
+
+        base::Time tStart = base::Time::now();
+        {
+            std::lock_guard<std::mutex> plannerLock(plannerMutex);
+            planner->localExpandableObstacles.clear();
+            planner->ingestTraversabilityMap(request.wPos, request.frame);
+            newObstacles = planner->localExpandableObstacles;
+            planner->expandRisk();
+        }
+        base::Time tEnd = base::Time::now();
+
+        if (!newObstacles.empty())
+        {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            if (pendingFrames == 0)
+                pendingStamp = request.stamp;
+            pendingObstacles.insert(pendingObstacles.end(), newObstacles.begin(), newObstacles.end());
+            pendingFrames++;
+        }
+        pendingReady.notify_one();
+
+        std::lock_guard<std::mutex> statisticsLock(statisticsMutex);
+        statistics.framesDropped += dropped;
+        statistics.framesIngested++;
+        statistics.queueWait.add(tStart - request.stamp);
+        statistics.ingestion.add(tEnd - tStart);
+    }
+}
+
+void PerceptionPipeline::planningLoop()
+{
+    std::vector<localNode*> obstacles;
+    while (true)
+    {
+        uint frames;
+        base::Time stamp;
+        {
+            std::unique_lock<std::mutex> lock(pendingMutex);
+            pendingReady.wait(lock, [this]{ return (pendingFrames > 0)||(!running); });
+            if (!running)
+                return;
+            obstacles.clear();
+            std::swap(obstacles, pendingObstacles);
+            frames = pendingFrames;
+            stamp = pendingStamp;
+            pendingFrames = 0;
+        }
+
+      // All the obstacles of the coalesced frames are evaluated against the
+      // current globalPath, so a single repair covers all of them
+        base::Time tStart = base::Time::now();
+        bool repaired = false;
+        {
+            std::lock_guard<std::mutex> plannerLock(plannerMutex);
+            uint minIndex = planner->globalPath.size(), maxIndex = 0;
+            for (uint i = 0; i < obstacles.size(); i++)
+                planner->isBlockingObstacle(obstacles[i], maxIndex, minIndex);
+            if ((minIndex < planner->globalPath.size())&&(!trajectory.empty()))
+            {
+                planner->repairPath(trajectory, minIndex, maxIndex);
+                repaired = true;
+                std::lock_guard<std::mutex> trajectoryLock(trajectoryMutex);
+                publishedTrajectory = trajectory;
+                trajectoryVersion++;
+            }
+        }
+        base::Time tEnd = base::Time::now();
+
+        std::lock_guard<std::mutex> statisticsLock(statisticsMutex);
+        statistics.framesCoalesced += frames - 1;
+        statistics.planning.add(tEnd - tStart);
+        statistics.endToEnd.add(tEnd - stamp);
+        if (repaired)
+            statistics.repairs++;
+    }
+}
+
+void PerceptionPipeline::setTrajectory(const std::vector<base::Waypoint>& _trajectory)
+{
+    std::lock_guard<std::mutex> plannerLock(plannerMutex);
+    trajectory = _trajectory;
+    std::lock_guard<std::mutex> trajectoryLock(trajectoryMutex);
+    publishedTrajectory = _trajectory;
+    trajectoryVersion++;
+}
+
+uint PerceptionPipeline::getTrajectory(std::vector<base::Waypoint>& _trajectory)
+{
+    std::lock_guard<std::mutex> trajectoryLock(trajectoryMutex);
+    _trajectory = publishedTrajectory;
+    return trajectoryVersion;
+}
+
+std::mutex& PerceptionPipeline::getPlannerMutex()
+{
+    return plannerMutex;
+}
+
+pipelineStatistics PerceptionPipeline::getStatistics()
+{
+    std::lock_guard<std::mutex> statisticsLock(statisticsMutex);
+    return statistics;
+}
+
+void PerceptionPipeline::resetStatistics()
+{
+    std::lock_guard<std::mutex> statisticsLock(statisticsMutex);
+    statistics = pipelineStatistics();
+}
@@ -0,0 +1,132 @@
+#ifndef _PATHPLANNING_PERCEPTION_PIPELINE_HPP_
+#define _PATHPLANNING_PERCEPTION_PIPELINE_HPP_
+
+#include "PathPlanning.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace PathPlanning_lib
+{
+    enum queue_policy
+    {
+        LATEST_FRAME_WINS, // A full queue drops its oldest frame
+        BLOCK_PRODUCER     // A full queue blocks pushFrame until there is room
+    };
+
+    struct latencyHistogram
+    {
+        static const uint numBins = 32; //Bin i counts latencies below 2^i us
+        uint64_t bins[numBins];
+        uint64_t count;
+        double total; //In seconds
+        double max; //In seconds
+        latencyHistogram()
+        {
+            reset();
+        }
+        void reset();
+        void add(base::Time latency);
+        double percentile(double p) const; //Upper bound of the bin, in seconds
+    };
+
+    struct pipelineStatistics
+    {
+        latencyHistogram queueWait; //Frame pushed -> ingestion starts
+        latencyHistogram ingestion; //Obstacle ingestion and risk expansion
+        latencyHistogram planning; //Blocking evaluation and repairPath
+        latencyHistogram endToEnd; //Oldest coalesced frame pushed -> repaired
+        uint64_t framesReceived;
+        uint64_t framesDropped;
+        uint64_t framesIngested;
+        uint64_t framesCoalesced; //Frames merged into an already pending repair
+        uint64_t repairs;
+        pipelineStatistics()
+        {
+            framesReceived = 0;
+            framesDropped = 0;
+            framesIngested = 0;
+            framesCoalesced = 0;
+            repairs = 0;
+        }
+    };
+
+    struct frameRequest
+    {
+        base::Waypoint wPos;
+        base::samples::frame::Frame frame;
+        base::Time stamp;
+    };
+
+//__PERCEPTION_PIPELINE_CLASS__
+    // Runs evaluateLocalMap as two pipelined stages on their own threads:
+    // ingestion (obstacles and risk) and planning (one repairPath for all the
+    // frames ingested while the previous repair was running). Every access to
+    // the planner goes through plannerMutex, which callers must also hold
+    // while using the planner themselves.
+    class PerceptionPipeline
+    {
+        private:
+            PathPlanning* planner;
+            queue_policy policy;
+            bool running;
+
+          // Bounded frame queue, slots are reused to avoid reallocations
+            std::vector<frameRequest> frameSlots;
+            uint queueHead;
+            uint queueCount;
+            std::mutex queueMutex;
+            std::condition_variable queueNotEmpty;
+            std::condition_variable queueNotFull;
+
+          // Obstacles ingested but not yet evaluated against globalPath
+            std::vector<localNode*> pendingObstacles;
+            uint pendingFrames;
+            base::Time pendingStamp;
+            std::mutex pendingMutex;
+            std::condition_variable pendingReady;
+
+            std::mutex plannerMutex;
+            std::vector<base::Waypoint> trajectory; //Working copy, plannerMutex
+
+            std::vector<base::Waypoint> publishedTrajectory;
+            uint trajectoryVersion;
+            std::mutex trajectoryMutex;
+
+            pipelineStatistics statistics;
+            std::mutex statisticsMutex;
+
+            std::thread ingestionThread;
+            std::thread planningThread;
+
+            bool enqueueFrame(base::Waypoint wPos,
+                              const base::samples::frame::Frame& traversabilityMap,
+                              bool wait);
+            void ingestionLoop();
+            void planningLoop();
+        public:
+            PerceptionPipeline(PathPlanning* _planner,
+                               uint queueCapacity = 2,
+                               queue_policy _policy = LATEST_FRAME_WINS);
+            ~PerceptionPipeline();
+
+            void start();
+            void stop();
+
+            bool pushFrame(base::Waypoint wPos,
+                           const base::samples::frame::Frame& traversabilityMap);
+            bool tryPushFrame(base::Waypoint wPos,
+                              const base::samples::frame::Frame& traversabilityMap);
+
+            void setTrajectory(const std::vector<base::Waypoint>& _trajectory);
+            uint getTrajectory(std::vector<base::Waypoint>& _trajectory);
+
+            std::mutex& getPlannerMutex();
+
+            pipelineStatistics getStatistics();
+            void resetStatistics();
+    };
+
+} // end namespace PathPlanning_lib
+
+#endif // _PATHPLANNING_PERCEPTION_PIPELINE_HPP_
@@ -0,0 +1,163 @@
+#include "PlannerLog.hpp"
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+
+using namespace PathPlanning_lib;
+
+static ConsoleLogSink consoleSink;
+static std::atomic<LogSink*> currentSink(&consoleSink);
+static std::atomic<int> currentLevel(LOG_LEVEL_DEBUG);
+
+void PathPlanning_lib::setLogSink(LogSink* sink)
+{
+    currentSink.store((sink == NULL) ? &consoleSink : sink);
+}
+
+void PathPlanning_lib::setLogLevel(log_level level)
+{
+    currentLevel.store(level, std::memory_order_relaxed);
+}
+
+log_level PathPlanning_lib::getLogLevel()
+{
+    return (log_level)currentLevel.load(std::memory_order_relaxed);
+}
+
+bool PathPlanning_lib::isLogEnabled(log_level level)
+{
+    return ((int)level >= currentLevel.load(std::memory_order_relaxed))&&(level != LOG_LEVEL_NONE);
+}
+
+void PathPlanning_lib::logMessage(log_level level, const std::string& message)
+{
+    currentSink.load()->write(level, message);
+}
+
+
+void ConsoleLogSink::write(log_level level, const std::string& message)
+{
+    switch (level)
+    {
+        case LOG_LEVEL_WARNING:
+            std::cout << "PLANNER WARNING: " << message << std::endl;
+            break;
+        case LOG_LEVEL_ERROR:
+            std::cout << "PLANNER ERROR: " << message << std::endl;
+            break;
+        default:
+            std::cout << "PLANNER: " << message << std::endl;
+    }
+}
+
+
+// Power of two of entries, at least capacity
+static uint64_t ringSize(uint capacity)
+{
+    uint64_t size = 1;
+    while (size < capacity)
+        size *= 2;
+    return size;
+}
+
+AsyncLogSink::AsyncLogSink(LogSink& _target, uint capacity):
+                           target(_target),
+                           ring(ringSize(capacity))
+{
+  // Entry k is free for position k, k+size, ... when its sequence equals
+  // the position, and holds a message for it when it equals position+1
+    mask = ring.size() - 1;
+    for (uint64_t k = 0; k < ring.size(); k++)
+        ring[k].sequence.store(k, std::memory_order_relaxed);
+    head.store(0);
+    tail.store(0);
+    dropped.store(0);
+    isRunning.store(true);
+    consumer = std::thread(&AsyncLogSink::run, this);
+}
+
+AsyncLogSink::~AsyncLogSink()
+{
+  // The consumer stops once every claimed position has been written
+    isRunning.store(false);
+    consumer.join();
+}
+
+void AsyncLogSink::write(log_level level, const std::string& message)
+{
+  // Any thread may write, a position is claimed on head and published
+  // through the sequence of its entry
+    uint64_t position = head.load(std::memory_order_relaxed);
+    logEntry* entry;
+    while (true)
+    {
+        entry = &ring[position & mask];
+        int64_t difference = (int64_t)entry->sequence.load(std::memory_order_acquire) - (int64_t)position;
+        if (difference == 0)
+        {
+            if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (difference < 0)
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else
+            position = head.load(std::memory_order_relaxed);
+    }
+    entry->level = level;
+    entry->length = std::min(message.size(), sizeof(entry->text));
+    memcpy(entry->text, message.data(), entry->length);
+    entry->sequence.store(position + 1, std::memory_order_release);
+}
+
+bool AsyncLogSink::pop(log_level& level, std::string& message)
+{
+  // Only the consumer thread pops, it advances tail once the message has
+  // been written to target
+    uint64_t position = tail.load(std::memory_order_relaxed);
+    logEntry& entry = ring[position & mask];
+    if (entry.sequence.load(std::memory_order_acquire) != position + 1)
+        return false;
+    level = entry.level;
+    message.assign(entry.text, entry.length);
+    entry.sequence.store(position + mask + 1, std::memory_order_release);
+    return true;
+}
+
+void AsyncLogSink::run()
+{
+  // Pending messages are still written after the sink is stopped, also
+  // those whose position was claimed but not yet published by a writer
+    log_level level;
+    std::string message;
+    while (true)
+    {
+        if (pop(level, message))
+        {
+            target.write(level, message);
+            tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+        else if (isRunning.load())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        else if (tail.load(std::memory_order_relaxed) != head.load(std::memory_order_acquire))
+            std::this_thread::yield();
+        else
+            break;
+    }
+}
+
+void AsyncLogSink::flush()
+{
+  // Waits until the messages written so far have reached target
+    uint64_t position = head.load(std::memory_order_acquire);
+    while (tail.load(std::memory_order_acquire) < position)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+uint64_t AsyncLogSink::getDropped()
+{
+    return dropped.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,105 @@
+#ifndef _PATHPLANNING_PLANNER_LOG_HPP_
+#define _PATHPLANNING_PLANNER_LOG_HPP_
+
+#include <atomic>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+// Messages below PATH_PLANNING_LOG_LEVEL are removed at compile time, their
+// arguments are not even evaluated. Debug messages are kept only in builds
+// without NDEBUG unless the level is given explicitly
+#ifndef PATH_PLANNING_LOG_LEVEL
+#ifdef NDEBUG
+#define PATH_PLANNING_LOG_LEVEL 1
+#else
+#define PATH_PLANNING_LOG_LEVEL 0
+#endif
+#endif
+
+#define PLANNER_LOG(level, message) \
+    do { \
+        if (((int)(level) >= PATH_PLANNING_LOG_LEVEL) && PathPlanning_lib::isLogEnabled(level)) \
+        { \
+            std::ostringstream logStream; \
+            logStream << message; \
+            PathPlanning_lib::logMessage(level, logStream.str()); \
+        } \
+    } while (0)
+
+#define PLANNER_DEBUG(message) PLANNER_LOG(PathPlanning_lib::LOG_LEVEL_DEBUG, message)
+#define PLANNER_INFO(message) PLANNER_LOG(PathPlanning_lib::LOG_LEVEL_INFO, message)
+#define PLANNER_WARNING(message) PLANNER_LOG(PathPlanning_lib::LOG_LEVEL_WARNING, message)
+#define PLANNER_ERROR(message) PLANNER_LOG(PathPlanning_lib::LOG_LEVEL_ERROR, message)
+
+namespace PathPlanning_lib
+{
+    enum log_level
+    {
+        LOG_LEVEL_DEBUG,   // Progress of every phase, for development
+        LOG_LEVEL_INFO,    // One line per planning request
+        LOG_LEVEL_WARNING, // Requests that could only be partially served
+        LOG_LEVEL_ERROR,   // Failures
+        LOG_LEVEL_NONE
+    };
+
+    class LogSink
+    {
+        public:
+            virtual ~LogSink() {}
+            virtual void write(log_level level, const std::string& message) = 0;
+    };
+
+    // Writes every message to std::cout as a "PLANNER: " line, warnings and
+    // errors as "PLANNER WARNING: " and "PLANNER ERROR: " lines
+    class ConsoleLogSink : public LogSink
+    {
+        public:
+            void write(log_level level, const std::string& message);
+    };
+
+    // Queues messages in a bounded lock-free ring and writes them to target
+    // from its own thread, so the planner never waits on the target. When
+    // the ring is full messages are dropped and counted
+    class AsyncLogSink : public LogSink
+    {
+        private:
+            struct logEntry
+            {
+                std::atomic<uint64_t> sequence; //Position this entry can be taken at
+                log_level level;
+                uint length;
+                char text[240]; //Longer messages are truncated
+            };
+
+            LogSink& target;
+            std::vector<logEntry> ring;
+            uint64_t mask;
+            std::atomic<uint64_t> head; //Next position to be claimed by a writer
+            std::atomic<uint64_t> tail; //Next position to be written to target
+            std::atomic<uint64_t> dropped;
+            std::atomic<bool> isRunning;
+            std::thread consumer;
+
+            bool pop(log_level& level, std::string& message);
+            void run();
+        public:
+            AsyncLogSink(LogSink& _target, uint capacity = 1024);
+            ~AsyncLogSink();
+
+            void write(log_level level, const std::string& message);
+            void flush();
+            uint64_t getDropped();
+    };
+
+    void setLogSink(LogSink* sink); //NULL restores the console sink
+    void setLogLevel(log_level level); //Runtime filter on top of the compile time one
+    log_level getLogLevel();
+    bool isLogEnabled(log_level level);
+    void logMessage(log_level level, const std::string& message);
+
+} // end namespace PathPlanning_lib
+
+#endif // _PATHPLANNING_PLANNER_LOG_HPP_